@@ -11,22 +11,54 @@
 
 #include <linux/mod_devicetable.h>
 #include <linux/device.h>
+#include <linux/ktime.h>
 
 #define MCU_NAME_SIZE 20
 
 #define MCU_DEVICE_ERROR_ID	0xf0
+/* error codes of error responses, returned negated */
+#define MCU_ERROR_INVALID_DEVICE	0xf0
+#define MCU_ERROR_INVALID_CODE	0xf1
 typedef unsigned char mcu_device_id;
 typedef unsigned char mcu_control_code;
 
+/*
+ * frames share the line by class, higher classes go first
+ * but lower ones still get their share
+ */
+enum mcu_tx_class {
+	MCU_TX_NORMAL,	// default
+	MCU_TX_URGENT,	// short commands waited on by users
+	MCU_TX_BULK,	// large transfers
+	MCU_TX_CLASSES,
+};
+
 struct mcu_bus_device;
+struct mcu_latency;
+
+/* reachability of the mcu, checked by a heartbeat of the bus */
+enum mcu_link_state {
+	MCU_LINK_UP,
+	// heartbeats missed, commands are still sent
+	MCU_LINK_DEGRADED,
+	// commands fail with -ENOLINK until the mcu answers again
+	MCU_LINK_DOWN,
+};
 
 struct mcu_device {
 	mcu_device_id device_id;
 	char name[MCU_NAME_SIZE];
 	struct mcu_bus_device *bus;
+	// class of commands sent, taken from the driver on probe
+	enum mcu_tx_class tx_class;
+	// control codes sent again when the response is late, taken from the driver on probe
+	const char *retry_codes;
 	struct device dev;
 
 	struct list_head node;
+	// private to the bus, command latency by control code and its debugfs directory
+	struct mcu_latency *latency;
+	struct dentry *debugfs;
 };
 #define to_mcu_device(d) container_of(d, struct mcu_device, dev)
 
@@ -45,6 +77,12 @@ struct mcu_driver {
 
 	struct device_driver driver;
 	const struct mcu_device_id *id_table;
+	// transmit class of the devices bound
+	enum mcu_tx_class tx_class;
+	// optional, control codes safe to send twice, like reads, fills and draws
+	const char *retry_codes;
+	// optional, the link went down or is back up, the mcu may have been reset meanwhile
+	void (*link_change)(struct mcu_device *, enum mcu_link_state);
 
 	struct list_head devices;
 };
@@ -72,9 +110,77 @@ static inline void mcu_set_drvdata(struct mcu_device *device, void *data)
 
 /* send command with device */
 extern int mcu_device_command(struct mcu_device *device, mcu_control_code cmd, unsigned char *buffer, int len);
+/* same, in another transmit class than the one of the device */
+extern int mcu_device_command_class(struct mcu_device *device, enum mcu_tx_class tx_class, mcu_control_code cmd, unsigned char *buffer, int len);
+
+/* one command of a batch, buffer holds the detail and receives the response */
+struct mcu_command {
+	mcu_control_code cmd;
+	unsigned char *buffer;
+	int len;
+	// response length or negative error code, as mcu_device_command() returns
+	int ret;
+};
+
+/* send several commands with device in as few round trips as possible */
+extern int mcu_device_command_batch(struct mcu_device *device, struct mcu_command *cmds, int count);
+
+struct mcu_async_command;
+struct mcu_tx_frame;
+
+/* the command is idempotent, it is sent again when the response is late and the link is tagged */
+#define MCU_COMMAND_RETRY	0x01
+
+/* called once from the bus worker, must not block the bus for long */
+typedef void (*mcu_command_complete_t)(struct mcu_async_command *);
+
+/*
+ * a command completed in the background, the caller keeps it until complete is called,
+ * buffer holds the detail and receives the response
+ */
+struct mcu_async_command {
+	mcu_control_code cmd;
+	unsigned char *buffer;
+	int len;
+	// ms, 0 for the default of mcu_device_command()
+	int timeout;
+	unsigned int flags;
+	mcu_command_complete_t complete;
+	void *context;
+	// response length or negative error code, as mcu_device_command() returns
+	int ret;
+
+	// private to the bus
+	struct mcu_bus_device *bus;
+	mcu_device_id device_id;
+	enum mcu_tx_class tx_class;
+	struct mcu_tx_frame *frame;
+	ktime_t submitted;
+	ktime_t dispatched;
+	ktime_t expires;
+	ktime_t sent;
+	ktime_t retransmit;
+	ktime_t replied;
+	int attempts;
+	int canceled;
+	struct list_head node;
+};
+
+/*
+ * send command with device without waiting, may be called in atomic context,
+ * MCU_COMMAND_RETRY is added for the retry codes of the driver
+ */
+extern int mcu_device_command_async(struct mcu_device *device, struct mcu_async_command *command);
+/* complete is called with -ECANCELED, unless the command completed already */
+extern void mcu_device_command_cancel(struct mcu_async_command *command);
+
+/* frames queued on the bus not completely written yet, bytes is optional */
+extern int mcu_device_tx_pending(struct mcu_device *device, int *bytes);
 
 /* use ping to check availability of the peer mcu */
 extern int mcu_check_ping(struct mcu_device *device);
+/* as last seen by the heartbeat, without waiting for the mcu */
+extern enum mcu_link_state mcu_device_link_state(struct mcu_device *device);
 
 #endif	// __LINUX_MCU_H_
 
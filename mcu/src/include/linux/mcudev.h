@@ -0,0 +1,91 @@
+/*
+ * mcudev.h
+ * raw control channel of an mcu bus, /dev/mcuN
+ *
+ * Author: Alex.wang
+ * Create: 2015-09-05 15:31
+ */
+
+
+#ifndef _LINUX_MCUDEV_H
+#define _LINUX_MCUDEV_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* longest detail of a request, larger ones need segmented transfers on the link */
+#define MCUDEV_LEN_MAX	2048
+/* requests of an open file submitted and not reaped yet */
+#define MCUDEV_REQUESTS_MAX	256
+
+/* transmit class of a request, as enum mcu_tx_class */
+#define MCUDEV_TX_NORMAL	0
+#define MCUDEV_TX_URGENT	1
+#define MCUDEV_TX_BULK	2
+
+/*
+ * request flags, the request is idempotent and sent again when the response is late,
+ * other bits and reserved fields must be 0
+ */
+#define MCUDEV_RETRY	0x01
+
+/*
+ * a control request, as mcu_device_command():
+ * len bytes of buffer are sent, the response is received into buffer up to len
+ */
+struct mcudev_request {
+	__u64 buffer;	// user pointer
+	__u64 user_data;	// returned in the completion
+	__u32 len;
+	__u32 timeout;	// ms, 0 for the default of the bus
+	__u32 flags;
+	__u8 device_id;
+	__u8 cmd;
+	__u8 tx_class;
+	__u8 reserved;
+};
+
+struct mcudev_completion {
+	__u64 user_data;
+	// response length or negative error code
+	__s32 ret;
+	__u8 device_id;
+	__u8 cmd;
+	__u8 reserved[2];
+};
+
+/*
+ * submit nr_requests requests, then reap up to nr_completions completions,
+ * waiting for min_complete of them at least as long as requests are in flight
+ */
+struct mcudev_submit {
+	__u64 requests;	// user pointer to struct mcudev_request[nr_requests]
+	__u64 completions;	// user pointer to struct mcudev_completion[nr_completions]
+	__u32 nr_requests;
+	__u32 nr_completions;
+	__u32 min_complete;
+	// out, requests submitted, stops at the first one failing, and completions reaped
+	__u32 submitted;
+	__u32 completed;
+	__u32 reserved;
+};
+
+/*
+ * requests the mcu sends to a claimed device id without a kernel driver,
+ * read() returns one at a time, header followed by len bytes of detail
+ */
+struct mcudev_report {
+	__u8 device_id;
+	__u8 cmd;
+	__u16 len;
+	__u8 detail[0];
+};
+
+/* ioctl code */
+#define MCUDEV_MAGIC	0xa9
+#define MCUDEV_IOC_SUBMIT	_IOWR(MCUDEV_MAGIC, 1, struct mcudev_submit)
+// claim reports of a device id, the argument is the device id
+#define MCUDEV_IOC_CLAIM	_IO(MCUDEV_MAGIC, 2)
+#define MCUDEV_IOC_RELEASE	_IO(MCUDEV_MAGIC, 3)
+
+#endif /* _LINUX_MCUDEV_H */
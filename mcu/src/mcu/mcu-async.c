@@ -0,0 +1,349 @@
+/*
+ * mcu-async.c
+ * mcu coprocessor bus protocol, asynchronous commands
+ *
+ * Author: Alex.wang
+ * Create: 2015-08-16 09:47
+ */
+
+#include <linux/module.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include "mcu-internal.h"
+#include "mcu-packet.h"
+#include "mcu-event.h"
+#include "mcu-trace.h"
+
+/*
+ * retransmission timeout per class from the smoothed round trip time and its variance,
+ * in us, the initial one holds until the first response is in
+ */
+#define MCU_RTO_INIT	1000000
+#define MCU_RTO_MIN	10000
+#define MCU_RTO_MAX	(MCU_COMMAND_TIMEOUT * USEC_PER_MSEC)
+
+/* sends of a retried command, the timeout of the command bounds them as well */
+#define MCU_COMMAND_ATTEMPTS	4
+
+/*
+ * commands wait in async_queue for a slot of the window, then in async_inflight
+ * for the response, sending, timeouts and completion all happen in the bus worker
+ */
+
+/* rtt in us of a response to a command sent once, rfc 6298 */
+void mcu_bus_rtt_sample(struct mcu_bus_device *bus, enum mcu_tx_class tx_class, unsigned int rtt)
+{
+	struct mcu_bus_stats *stats = &bus->stats;
+	unsigned int srtt = stats->rtt[tx_class];
+	unsigned int delta;
+
+	if (!srtt) {
+		stats->rtt[tx_class] = max(rtt, 1U);
+		stats->rtt_var[tx_class] = rtt / 2;
+	}
+	else {
+		delta = rtt > srtt ? rtt - srtt : srtt - rtt;
+		stats->rtt_var[tx_class] = stats->rtt_var[tx_class] - stats->rtt_var[tx_class] / 4 + delta / 4;
+		stats->rtt[tx_class] = max(srtt - srtt / 8 + rtt / 8, 1U);
+	}
+	stats->rto[tx_class] = clamp(stats->rtt[tx_class] + 4 * stats->rtt_var[tx_class], (unsigned int)MCU_RTO_MIN, (unsigned int)MCU_RTO_MAX);
+}
+
+/* us to wait for a response before sending again */
+unsigned int mcu_bus_rto(struct mcu_bus_device *bus, enum mcu_tx_class tx_class)
+{
+	return READ_ONCE(bus->stats.rto[tx_class]);
+}
+
+/* the response is in, called while detecting with the frame locked */
+static void __mcu_async_response(struct mcu_tx_frame *frame)
+{
+	struct mcu_async_command *command = frame->context;
+
+	command->replied = ktime_get();
+	mcu_signal_event(command->bus, MCU_ASYNC_COMMAND);
+}
+
+static enum hrtimer_restart __mcu_async_timeout(struct hrtimer *timer)
+{
+	struct mcu_bus_device *bus = container_of(timer, struct mcu_bus_device, async_timer);
+
+	mcu_signal_event(bus, MCU_ASYNC_COMMAND);
+	return HRTIMER_NORESTART;
+}
+
+/* the command is off the lists, ret is used unless the response is in */
+static void __mcu_async_finish(struct mcu_bus_device *bus, struct mcu_async_command *command, int ret)
+{
+	struct mcu_packet *reply = NULL;
+	int len = command->len, tag = -1;
+	ktime_t now;
+
+	now = ktime_get();
+	if (command->frame) {
+		tag = command->frame->tag;
+		reply = mcu_packet_take_response(command->frame);
+		// a response arriving from now on is unmatched
+		mcu_tx_frame_free(command->frame);
+		command->frame = NULL;
+		up(&bus->tx_window);
+	}
+	if (reply) {
+		// a response to a command sent again may answer any of the sends
+		if (1 == command->attempts) {
+			mcu_bus_rtt_sample(bus, command->tx_class, ktime_us_delta(command->replied, command->sent));
+		}
+		mcu_bus_latency_record(bus, command->device_id, command->cmd, ktime_us_delta(now, command->submitted));
+		ret = mcu_packet_copy_control_detail(reply, command->buffer, &len);
+		if (ret >= 0 && ret < len) {
+			// buffer too small
+			ret = -ENOSPC;
+		}
+		mcu_packet_put(reply);
+	}
+	else if (-ETIME == ret) {
+		bus->stats.tx_timeouts++;
+		mcu_link_suspect(bus);
+	}
+
+	command->ret = ret;
+	trace_mcu_command_complete(bus->nr, command->device_id, command->cmd, command->len, tag, ret, command->attempts,
+		command->attempts ? ktime_us_delta(command->dispatched, command->submitted) : ktime_us_delta(now, command->submitted),
+		reply ? ktime_us_delta(command->replied, command->sent) : 0, ktime_us_delta(now, command->submitted));
+	// the caller may free the command from here on
+	command->complete(command);
+}
+
+/* the command holds a slot of the window and no frame */
+static int __mcu_async_send(struct mcu_bus_device *bus, struct mcu_async_command *command)
+{
+	struct mcu_tx_frame *frame;
+
+	// the response may be detected before the send returns
+	command->sent = ktime_get();
+	if (!command->attempts) {
+		command->dispatched = command->sent;
+	}
+	frame = mcu_packet_send_control_request(bus, command->tx_class, command->device_id, command->cmd, command->buffer, command->len, __mcu_async_response, command);
+	if (IS_ERR(frame)) {
+		return PTR_ERR(frame);
+	}
+	command->frame = frame;
+
+	// backed off exponentially
+	command->retransmit = ktime_add_us(command->sent, (u64)mcu_bus_rto(bus, command->tx_class) << command->attempts);
+	command->attempts++;
+	return 0;
+}
+
+/* the response is late, the frame is written again with its tag and keeps its slot of the window */
+static int __mcu_async_resend(struct mcu_bus_device *bus, struct mcu_async_command *command)
+{
+	int ret;
+
+	command->sent = ktime_get();
+	ret = mcu_packet_resend(bus, command->frame);
+	if (ret) {
+		return ret;
+	}
+	bus->stats.tx_retransmits++;
+
+	command->retransmit = ktime_add_us(command->sent, (u64)mcu_bus_rto(bus, command->tx_class) << command->attempts);
+	command->attempts++;
+	return 0;
+}
+
+/* sent again when late, only while the link is tagged */
+static int __mcu_async_retries(struct mcu_async_command *command)
+{
+	return (command->flags & MCU_COMMAND_RETRY) && command->attempts < MCU_COMMAND_ATTEMPTS && mcu_packet_can_resend(command->frame);
+}
+
+static int __mcu_async_expired(struct mcu_async_command *command, ktime_t now)
+{
+	return command->canceled || !ktime_before(now, command->expires);
+}
+
+static int __mcu_async_late(struct mcu_async_command *command, ktime_t now)
+{
+	return __mcu_async_retries(command) && !ktime_before(now, command->retransmit);
+}
+
+/* wake the worker when the next command expires or is due to be sent again, async_lock held */
+static void __mcu_async_arm(struct mcu_bus_device *bus)
+{
+	struct mcu_async_command *command;
+	ktime_t deadline, next = 0;
+	int pending = 0;
+
+	list_for_each_entry(command, &bus->async_inflight, node) {
+		deadline = command->expires;
+		if (__mcu_async_retries(command) && ktime_before(command->retransmit, deadline)) {
+			deadline = command->retransmit;
+		}
+		if (!pending++ || ktime_before(deadline, next)) {
+			next = deadline;
+		}
+	}
+	list_for_each_entry(command, &bus->async_queue, node) {
+		if (!pending++ || ktime_before(command->expires, next)) {
+			next = command->expires;
+		}
+	}
+
+	if (pending) {
+		hrtimer_start(&bus->async_timer, next, HRTIMER_MODE_ABS);
+	}
+	else {
+		hrtimer_try_to_cancel(&bus->async_timer);
+	}
+}
+
+/* complete what is done, timed out or canceled, send again what is late, then send what the window allows */
+void mcu_async_handle(struct mcu_bus_device *bus)
+{
+	struct mcu_async_command *command, *next;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	LIST_HEAD(done);
+	LIST_HEAD(late);
+	LIST_HEAD(send);
+	int ret, sent = 0;
+	int down = mcu_link_down(bus);
+
+	spin_lock_irqsave(&bus->async_lock, flags);
+	list_for_each_entry_safe(command, next, &bus->async_inflight, node) {
+		if (completion_done(&command->frame->done) || down || __mcu_async_expired(command, now)) {
+			list_move_tail(&command->node, &done);
+		}
+		else if (__mcu_async_late(command, now)) {
+			list_move_tail(&command->node, &late);
+		}
+	}
+	list_for_each_entry_safe(command, next, &bus->async_queue, node) {
+		if (down || __mcu_async_expired(command, now)) {
+			list_move_tail(&command->node, &done);
+		}
+	}
+	spin_unlock_irqrestore(&bus->async_lock, flags);
+
+	list_for_each_entry_safe(command, next, &done, node) {
+		list_del(&command->node);
+		__mcu_async_finish(bus, command, command->canceled ? -ECANCELED : down ? -ENOLINK : -ETIME);
+	}
+
+	// late ones go first, they had their slot already, in submit order as far as the window allows
+	list_splice_tail_init(&late, &send);
+	spin_lock_irqsave(&bus->async_lock, flags);
+	while (!list_empty(&bus->async_queue) && 0 == down_trylock(&bus->tx_window)) {
+		list_move_tail(bus->async_queue.next, &send);
+	}
+	spin_unlock_irqrestore(&bus->async_lock, flags);
+
+	list_for_each_entry_safe(command, next, &send, node) {
+		list_del(&command->node);
+		ret = command->frame ? __mcu_async_resend(bus, command) : __mcu_async_send(bus, command);
+		if (ret) {
+			// the frame gives back its slot once finished
+			if (!command->frame) {
+				up(&bus->tx_window);
+			}
+			__mcu_async_finish(bus, command, ret);
+			continue;
+		}
+		spin_lock_irqsave(&bus->async_lock, flags);
+		list_add_tail(&command->node, &bus->async_inflight);
+		spin_unlock_irqrestore(&bus->async_lock, flags);
+		sent++;
+	}
+	if (sent) {
+		mcu_tx_flush(bus);
+	}
+
+	spin_lock_irqsave(&bus->async_lock, flags);
+	__mcu_async_arm(bus);
+	spin_unlock_irqrestore(&bus->async_lock, flags);
+}
+
+/*
+ * never sleeps, the command is the caller's again once complete is called,
+ * the timeout covers the wait for a slot of the window as well
+ */
+int mcu_bus_command_async(struct mcu_bus_device *bus, enum mcu_tx_class tx_class, mcu_device_id device_id, struct mcu_async_command *command)
+{
+	unsigned long flags;
+
+	if (unlikely(!bus || !command || !command->complete)) {
+		return -EINVAL;
+	}
+	// fail fast, the heartbeat tells once the mcu is back
+	if (mcu_link_down(bus)) {
+		return -ENOLINK;
+	}
+
+	command->bus = bus;
+	command->tx_class = tx_class;
+	command->device_id = device_id;
+	command->frame = NULL;
+	command->attempts = 0;
+	command->canceled = 0;
+	command->ret = 0;
+	command->submitted = ktime_get();
+	command->expires = ktime_add_us(command->submitted, (u64)(command->timeout > 0 ? command->timeout : MCU_COMMAND_TIMEOUT) * USEC_PER_MSEC);
+
+	spin_lock_irqsave(&bus->async_lock, flags);
+	list_add_tail(&command->node, &bus->async_queue);
+	spin_unlock_irqrestore(&bus->async_lock, flags);
+
+	mcu_signal_event(bus, MCU_ASYNC_COMMAND);
+	return 0;
+}
+
+/* complete is called with -ECANCELED soon, unless the response is in already */
+void mcu_async_cancel(struct mcu_async_command *command)
+{
+	struct mcu_bus_device *bus = command->bus;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bus->async_lock, flags);
+	command->canceled = 1;
+	spin_unlock_irqrestore(&bus->async_lock, flags);
+
+	mcu_signal_event(bus, MCU_ASYNC_COMMAND);
+}
+
+void mcu_async_init(struct mcu_bus_device *bus)
+{
+	int i;
+
+	for (i = 0; i < MCU_TX_CLASSES; i++) {
+		bus->stats.rtt[i] = 0;
+		bus->stats.rtt_var[i] = 0;
+		bus->stats.rto[i] = MCU_RTO_INIT;
+	}
+	spin_lock_init(&bus->async_lock);
+	INIT_LIST_HEAD(&bus->async_queue);
+	INIT_LIST_HEAD(&bus->async_inflight);
+	hrtimer_init(&bus->async_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	bus->async_timer.function = __mcu_async_timeout;
+}
+
+/* the worker is stopped, commands left fail while their frames can still be freed */
+void mcu_async_deinit(struct mcu_bus_device *bus)
+{
+	struct mcu_async_command *command, *next;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	hrtimer_cancel(&bus->async_timer);
+
+	spin_lock_irqsave(&bus->async_lock, flags);
+	list_splice_tail_init(&bus->async_inflight, &done);
+	list_splice_tail_init(&bus->async_queue, &done);
+	spin_unlock_irqrestore(&bus->async_lock, flags);
+
+	list_for_each_entry_safe(command, next, &done, node) {
+		list_del(&command->node);
+		__mcu_async_finish(bus, command, -ESHUTDOWN);
+	}
+}
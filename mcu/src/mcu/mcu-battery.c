@@ -14,21 +14,34 @@
 #include "mcu-internal.h"
 
 #define MCU_BATTERY_STATUS_NOT_PRESENT 5
+/* a known capacity is returned at once, and refreshed in the background at most this often */
+#define MCU_BATTERY_REFRESH_MS	1000
 
 struct mcu_battery_private {
 	struct mcu_device *device;
 	struct power_supply battery;
-	struct mutex mutex;
+	// the values below, set from the bus worker as well, so never held across a command
+	spinlock_t lock;
 
 	int capacity;
 	int capacity_level;
 	int status;
 	int health;
 	int present;
+
+	// capacity refresh, refresh_done is completed while none is in flight
+	struct mcu_async_command refresh;
+	struct completion refresh_done;
+	unsigned char refresh_capacity;
+	unsigned long refreshed;
+	int capacity_valid;
 };
 
 void mcu_battery_set_status(struct mcu_battery_private *data, unsigned char status)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->lock, flags);
 	if (MCU_BATTERY_STATUS_NOT_PRESENT == status) {
 		data->present = 0;
 		data->status = 0;
@@ -37,10 +50,17 @@ void mcu_battery_set_status(struct mcu_battery_private *data, unsigned char stat
 		data->present = 1;
 		data->status = status;
 	}
+	spin_unlock_irqrestore(&data->lock, flags);
 }
 
+/* a capacity just read from the mcu */
 void mcu_battery_set_capacity(struct mcu_battery_private *data, unsigned char capacity)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->lock, flags);
+	data->refreshed = jiffies;
+	data->capacity_valid = 1;
 	data->capacity = capacity;
 	data->health = POWER_SUPPLY_HEALTH_GOOD;
 
@@ -60,8 +80,19 @@ void mcu_battery_set_capacity(struct mcu_battery_private *data, unsigned char ca
 		data->capacity_level = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
 		data->health = POWER_SUPPLY_HEALTH_DEAD;
 	}
+	spin_unlock_irqrestore(&data->lock, flags);
 }
 
+/* read a value under the lock */
+#define mcu_battery_get(data, field) ({	\
+	unsigned long __flags;	\
+	typeof((data)->field) __value;	\
+	spin_lock_irqsave(&(data)->lock, __flags);	\
+	__value = (data)->field;	\
+	spin_unlock_irqrestore(&(data)->lock, __flags);	\
+	__value;	\
+})
+
 static int mcu_battery_command(struct mcu_battery_private *data, mcu_control_code cmd, unsigned char *value)
 {
 	struct mcu_device *device = data->device;
@@ -82,7 +113,7 @@ static int mcu_battery_command(struct mcu_battery_private *data, mcu_control_cod
 static void mcu_battery_update_status_on_demand(struct mcu_battery_private *data)
 {
 	unsigned char value = 0;
-	if (data->status) {
+	if (mcu_battery_get(data, status)) {
 		return;
 	}
 	if (mcu_battery_command(data, 'S', &value) == 1) {
@@ -90,18 +121,73 @@ static void mcu_battery_update_status_on_demand(struct mcu_battery_private *data
 	}
 }
 
+static void mcu_battery_refresh_complete(struct mcu_async_command *command)
+{
+	struct mcu_battery_private *data = command->context;
+	unsigned long flags;
+
+	if (command->ret == 1) {
+		mcu_battery_set_capacity(data, data->refresh_capacity);
+	}
+	else {
+		// not tried again before the next period either
+		spin_lock_irqsave(&data->lock, flags);
+		data->refreshed = jiffies;
+		spin_unlock_irqrestore(&data->lock, flags);
+	}
+	complete(&data->refresh_done);
+}
+
+static void mcu_battery_refresh_capacity(struct mcu_battery_private *data)
+{
+	if (time_before(jiffies, mcu_battery_get(data, refreshed) + msecs_to_jiffies(MCU_BATTERY_REFRESH_MS))) {
+		return;
+	}
+	if (!try_wait_for_completion(&data->refresh_done)) {
+		// still in flight
+		return;
+	}
+
+	data->refresh.cmd = 'C';
+	data->refresh.buffer = &data->refresh_capacity;
+	data->refresh.len = sizeof(data->refresh_capacity);
+	data->refresh.timeout = 0;
+	data->refresh.flags = 0;
+	data->refresh.complete = mcu_battery_refresh_complete;
+	data->refresh.context = data;
+	if (mcu_device_command_async(data->device, &data->refresh)) {
+		complete(&data->refresh_done);
+	}
+}
+
 static void mcu_battery_update_capacity_on_demand(struct mcu_battery_private *data)
 {
-	unsigned char value = 0;
+	unsigned char status = 0, capacity = 0;
+	// before update capacity, update status first, in the same round trip
+	struct mcu_command cmds[] = {
+		{ .cmd = 'S', .buffer = &status, .len = sizeof(status) },
+		{ .cmd = 'C', .buffer = &capacity, .len = sizeof(capacity) },
+	};
+	int skip = mcu_battery_get(data, status) ? 1 : 0;
+
+	if (mcu_battery_get(data, capacity_valid)) {
+		mcu_battery_refresh_capacity(data);
+		return;
+	}
 
-	// before update capacity, update status first
-	mcu_battery_update_status_on_demand(data);
+	if (mcu_device_command_batch(data->device, &cmds[skip], ARRAY_SIZE(cmds) - skip) < 0) {
+		dev_warn(&data->device->dev, "failed to send batch: cmds=%d\n", (int)ARRAY_SIZE(cmds) - skip);
+		return;
+	}
 
+	if (!skip && cmds[0].ret == 1) {
+		mcu_battery_set_status(data, status);
+	}
 	if (data->capacity) {
 		//return;
 	}
-	if (mcu_battery_command(data, 'C', &value) == 1) {
-		mcu_battery_set_capacity(data, value);
+	if (cmds[1].ret == 1) {
+		mcu_battery_set_capacity(data, capacity);
 	}
 }
 
@@ -117,23 +203,23 @@ static int mcu_battery_get_property(struct power_supply *psy,
 		break;
 	case POWER_SUPPLY_PROP_STATUS:
 		mcu_battery_update_status_on_demand(data);
-		val->intval = data->status;
+		val->intval = mcu_battery_get(data, status);
 		break;
 	case POWER_SUPPLY_PROP_HEALTH:
 		mcu_battery_update_capacity_on_demand(data);
-		val->intval = data->health;
+		val->intval = mcu_battery_get(data, health);
 		break;
 	case POWER_SUPPLY_PROP_CAPACITY:
 		mcu_battery_update_capacity_on_demand(data);
-		val->intval = data->capacity;
+		val->intval = mcu_battery_get(data, capacity);
 		break;
 	case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
 		mcu_battery_update_capacity_on_demand(data);
-		val->intval = data->capacity_level;
+		val->intval = mcu_battery_get(data, capacity_level);
 		break;
 	case POWER_SUPPLY_PROP_PRESENT:
 		mcu_battery_update_status_on_demand(data);
-		val->intval = data->present;
+		val->intval = mcu_battery_get(data, present);
 		break;
 	default:
 		return -EINVAL;
@@ -166,7 +252,9 @@ static int mcu_battery_probe(struct mcu_device *device, const struct mcu_device_
 		}
 
 		{
-			mutex_init(&data->mutex);
+			spin_lock_init(&data->lock);
+			init_completion(&data->refresh_done);
+			complete(&data->refresh_done);
 			mcu_set_drvdata(device, data);
 			data->device = device;
 
@@ -193,7 +281,6 @@ static int mcu_battery_probe(struct mcu_device *device, const struct mcu_device_
 	return ret;
 
 exit_misc_device_reg_failed:
-	mutex_destroy(&data->mutex);
 	kfree(data);
 exit_alloc_data_failed:
 	return ret;
@@ -204,7 +291,10 @@ static int mcu_battery_remove(struct mcu_device *device)
 	struct mcu_battery_private *data = mcu_get_drvdata(device);
 
 	power_supply_unregister(&data->battery);
-	mutex_destroy(&data->mutex);
+	if (!try_wait_for_completion(&data->refresh_done)) {
+		mcu_device_command_cancel(&data->refresh);
+		wait_for_completion(&data->refresh_done);
+	}
 	kfree(data);
 	return 0;
 }
@@ -244,6 +334,22 @@ static struct mcu_device_id mcu_battery_id[] = {
 	{ }
 };
 
+/* the mcu may have been reset, read status and capacity again on the next request */
+static void mcu_battery_link_change(struct mcu_device *device, enum mcu_link_state state)
+{
+	struct mcu_battery_private *data = mcu_get_drvdata(device);
+	unsigned long flags;
+
+	if (MCU_LINK_UP != state) {
+		return;
+	}
+	spin_lock_irqsave(&data->lock, flags);
+	data->status = 0;
+	data->capacity_valid = 0;
+	spin_unlock_irqrestore(&data->lock, flags);
+	power_supply_changed(&data->battery);
+}
+
 struct mcu_driver __mcu_battery = {
 	.driver	= {
 		.name	= "mcu-battery",
@@ -255,5 +361,7 @@ struct mcu_driver __mcu_battery = {
 	.remove	= mcu_battery_remove,
 	.id_table	= mcu_battery_id,
 	.report	= mcu_battery_report,
+	.link_change	= mcu_battery_link_change,
+	.retry_codes	= "SC",
 };
 
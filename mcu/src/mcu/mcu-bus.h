@@ -11,29 +11,219 @@
 #define __MCU_BUS_H_
 
 #include <linux/device.h>
+#include <linux/semaphore.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/llist.h>
+#include <linux/hrtimer.h>
+
+/* link management pseudo device, in the reserved device id range */
+#define MCU_LINK_DEVICE_ID	0xf1
+#define MCU_LINK_FEATURES	'F'	// detail: features, window, transfer size
+#define MCU_LINK_BAUD	'B'	// detail: baud rate
+/* link features */
+#define MCU_LINK_FEATURE_TAGGED	0x01	// tagged requests and responses
+#define MCU_LINK_FEATURE_BATCH	0x02	// batch requests and responses
+#define MCU_LINK_FEATURE_SEGMENT	0x04	// segmented transfers
+#define MCU_LINK_FEATURE_BAUD	0x08	// baud rate switch
+
+#define MCU_BAUD_RATES_MAX	4
+
+/* one slot per mcu_device_id */
+#define MCU_BUS_DEVICES	256
+
+/* responses are waited for this long at most, in ms */
+#define MCU_COMMAND_TIMEOUT	3000
+
+/* command latency histogram buckets, log2 of us, the first up to 2^MCU_LATENCY_SHIFT us */
+#define MCU_LATENCY_BUCKETS	16
+#define MCU_LATENCY_SHIFT	6
+
+/*
+ * a device uses a few control codes, each gets a slot the first time it is answered,
+ * codes beyond the last slot share it
+ */
+#define MCU_LATENCY_SLOTS	16
+#define MCU_LATENCY_OTHER	(MCU_LATENCY_SLOTS - 1)
+
+/* per cpu, by slot */
+struct mcu_latency_histogram {
+	unsigned int count[MCU_LATENCY_SLOTS][MCU_LATENCY_BUCKETS];
+};
+
+struct mcu_latency {
+	// slot + 1 by control code, 0 until the code is first answered
+	u8 slot[256];
+	int nr_slots;
+	spinlock_t lock;
+	struct mcu_latency_histogram __percpu *histogram;
+};
+
+/* counters of a bus, shown in sysfs under mcu-N/statistics, all of them in debugfs under mcu/mcu-N/stats */
+struct mcu_bus_stats {
+	// bytes received and frames detected, segments counted each
+	unsigned long rx_bytes;
+	unsigned long rx_frames;
+	// bad headers, bad message bodies, bytes skipped looking for a frame
+	unsigned long rx_header_errors;
+	unsigned long rx_checksum_errors;
+	unsigned long rx_resync_bytes;
+	// receive ring, bytes dropped as it was full
+	unsigned int rx_fifo_size;
+	unsigned int rx_fifo_high_watermark;
+	unsigned long rx_overrun_bytes;
+	// receive packet pool exhausted
+	unsigned long rx_packet_dropped;
+	// segmented transfers lost, aborted or too large
+	unsigned long rx_transfer_dropped;
+	// responses no request was waiting for
+	unsigned long rx_response_unmatched;
+	// receive polls, frames detected by them, most in one poll, polls out of budget
+	unsigned long rx_polls;
+	unsigned long rx_poll_frames;
+	unsigned int rx_poll_frames_max;
+	unsigned long rx_poll_exhausted;
+	// polls in the receive context
+	unsigned long rx_direct_polls;
+	// transmit frame pool exhausted
+	unsigned long tx_frame_exhausted;
+	// transmit queue, frames and bytes not written yet, frames refused
+	unsigned int tx_queue_size;
+	unsigned int tx_queue_depth;
+	unsigned int tx_queue_bytes;
+	unsigned long tx_queue_full;
+	// frames and bytes queued, and backend writes they were coalesced into
+	unsigned long tx_frames;
+	unsigned long tx_bytes;
+	unsigned long tx_writes;
+	// us from queued to written per class, moving average and max
+	unsigned int tx_latency[MCU_TX_CLASSES];
+	unsigned int tx_latency_max[MCU_TX_CLASSES];
+	// us per class, smoothed round trip time, its variance and the timeout derived
+	unsigned int rtt[MCU_TX_CLASSES];
+	unsigned int rtt_var[MCU_TX_CLASSES];
+	unsigned int rto[MCU_TX_CLASSES];
+	// commands and pings sent again as the response was late, and never answered
+	unsigned long tx_retransmits;
+	unsigned long tx_timeouts;
+	// times the heartbeat found the link down
+	unsigned long link_downs;
+	// requests allowed in flight
+	unsigned int tx_window;
+	// line rate agreed with the mcu
+	unsigned int baud;
+};
 
 struct mcu_bus_device {
 	char name[MCU_NAME_SIZE];
 	struct device dev;
 
 	int (*late_init)(struct mcu_bus_device *);
+	// called from the transmit queue only, may write less than len
 	int (*do_write)(struct mcu_bus_device *, const void *ptr, int len);
+	// optional, bytes written but not on the line yet, negative error code if unknown
+	int (*out_pending)(struct mcu_bus_device *);
+	// optional, line rates to try in order of preference, and the safe one
+	int (*set_baud)(struct mcu_bus_device *, unsigned int baud);
+	unsigned int baud_rates[MCU_BAUD_RATES_MAX];
+	int nr_baud_rates;
+	unsigned int fallback_baud;
 	int nr;
 	// used by mcu-packet
 	void *pkt_data;
-	// used by mcu-event
-	spinlock_t event_lock;
-	wait_queue_head_t wait_queue;
-	struct list_head event_list;
+	struct mcu_bus_stats stats;
+	// used by mcu-tx
+	void *tx_data;
+	// used by mcu-link
+	unsigned int link_features;
+	unsigned int link_transfer_size;
+	struct semaphore tx_window;
+	struct work_struct link_work;
+	struct delayed_work link_heartbeat;
+	enum mcu_link_state link_state;
+	int link_misses;
+	int link_stopping;
+	int link_recovering;
+	// used by mcu-async, commands waiting for the window and for the response
+	spinlock_t async_lock;
+	struct list_head async_queue;
+	struct list_head async_inflight;
+	struct hrtimer async_timer;
+	// used by mcu-event, events handled in order by the worker of the bus
+	struct llist_head event_queue;
+	unsigned long event_flags;
+	struct task_struct __rcu *event_task;
 
 	struct completion dev_released;
+	struct mutex children_lock;
 	struct list_head children;
+	// devices by id for dispatch, read under srcu, written with children_lock held
+	struct mcu_device __rcu *devices[MCU_BUS_DEVICES];
+	// used by mcu-debugfs
+	struct dentry *debugfs;
+	// used by mcu-dev
+	void *dev_data;
 };
 #define to_mcu_bus_device(d) container_of(d, struct mcu_bus_device, dev)
 
 extern void mcu_write_complete(struct mcu_bus_device *);
 extern int mcu_receive(struct mcu_bus_device *, const unsigned char *, size_t);
 
+/* send command to any device id on the bus, timeout in ms */
+extern int mcu_bus_command(struct mcu_bus_device *, enum mcu_tx_class, mcu_device_id, mcu_control_code, unsigned char *buffer, int len, int timeout);
+extern int mcu_bus_ping(struct mcu_bus_device *, int timeout);
+
+extern int mcu_tx_init(struct mcu_bus_device *);
+extern void mcu_tx_deinit(struct mcu_bus_device *);
+/* queue a whole frame, waiting up to timeout ms for room */
+extern int mcu_tx_queue_frame(struct mcu_bus_device *, const void *cp, int count, enum mcu_tx_class, int timeout);
+/* write queued frames now, for callers waiting on a response */
+extern void mcu_tx_flush(struct mcu_bus_device *);
+extern int mcu_tx_pending(struct mcu_bus_device *, int *bytes);
+
+extern void mcu_async_init(struct mcu_bus_device *);
+extern void mcu_async_deinit(struct mcu_bus_device *);
+/* never sleeps, complete is called from the bus worker */
+extern int mcu_bus_command_async(struct mcu_bus_device *, enum mcu_tx_class, mcu_device_id, struct mcu_async_command *);
+extern void mcu_async_cancel(struct mcu_async_command *);
+/* called by the bus worker on MCU_ASYNC_COMMAND */
+extern void mcu_async_handle(struct mcu_bus_device *);
+extern void mcu_bus_rtt_sample(struct mcu_bus_device *, enum mcu_tx_class, unsigned int rtt);
+extern unsigned int mcu_bus_rto(struct mcu_bus_device *, enum mcu_tx_class);
+
+/* count a command answered after us, by device and control code */
+extern void mcu_bus_latency_record(struct mcu_bus_device *, mcu_device_id, mcu_control_code, unsigned int us);
+
+extern void mcu_debugfs_init(void) __init;
+extern void mcu_debugfs_exit(void);
+extern void mcu_debugfs_add_bus(struct mcu_bus_device *);
+extern void mcu_debugfs_remove_bus(struct mcu_bus_device *);
+/* the histogram is freed once no command can record to the device */
+extern void mcu_debugfs_add_device(struct mcu_device *);
+extern void mcu_debugfs_remove_device(struct mcu_device *);
+extern void mcu_latency_record(struct mcu_device *, mcu_control_code, unsigned int us);
+
+#ifdef CONFIG_MCU_DEV
+/* /dev/mcuN, added once the worker runs and removed once it stopped */
+extern int mcu_dev_add_bus(struct mcu_bus_device *);
+extern void mcu_dev_remove_bus(struct mcu_bus_device *);
+/* from the bus worker, a request to a device id without a kernel device */
+extern void mcu_dev_report(struct mcu_bus_device *, mcu_device_id, mcu_control_code, const unsigned char *detail, int len);
+#endif
+
+/* tell the drivers bound, in process context */
+extern void mcu_bus_link_change(struct mcu_bus_device *, enum mcu_link_state);
+
+extern void mcu_link_init(struct mcu_bus_device *);
+extern void mcu_link_start(struct mcu_bus_device *);
+extern void mcu_link_stop(struct mcu_bus_device *);
+/* after the bus worker stopped */
+extern void mcu_link_deinit(struct mcu_bus_device *);
+/* a response is missing, check the link now, may be called in atomic context */
+extern void mcu_link_suspect(struct mcu_bus_device *);
+extern int mcu_link_down(struct mcu_bus_device *);
+extern const char *mcu_link_state_name(enum mcu_link_state);
+
 extern int mcu_add_bus_device(struct mcu_bus_device *);
 extern void mcu_remove_bus_device(struct mcu_bus_device *);
 
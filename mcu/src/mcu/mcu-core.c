@@ -13,9 +13,12 @@
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
+#include <linux/kthread.h>
 #include <linux/delay.h>
+#include <linux/srcu.h>
 #include <linux/mcu.h>
 #include "mcu-internal.h"
 #include "mcu-packet.h"
@@ -29,71 +32,252 @@ struct bus_type mcu_bus_type;
 struct device_type mcu_bus_dev_type;
 struct device_type mcu_dev_type;
 
+/* report callbacks may sleep, removing a device waits for those running */
+DEFINE_STATIC_SRCU(mcu_device_srcu);
+
+/* detect frames right in the receive context, only requests are left to the bus worker */
+static bool rx_direct;
+module_param(rx_direct, bool, 0644);
+MODULE_PARM_DESC(rx_direct, "complete responses and answer pings in the receive context");
+
+/* pings are sent this often at most within the timeout */
+#define MCU_PING_ATTEMPTS	4
+
+static void __mcu_bus_command_complete(struct mcu_async_command *command)
+{
+	complete(command->context);
+}
+
+static int __mcu_bus_command(struct mcu_bus_device *bus, enum mcu_tx_class tx_class, mcu_device_id device_id, mcu_control_code cmd, unsigned char *buffer, int len, int timeout, unsigned int flags)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct mcu_async_command command = {
+		.cmd	= cmd,
+		.buffer	= buffer,
+		.len	= len,
+		.timeout	= timeout,
+		.flags	= flags,
+		.complete	= __mcu_bus_command_complete,
+		.context	= &done,
+	};
+	int ret;
+
+	ret = mcu_bus_command_async(bus, tx_class, device_id, &command);
+	if (ret) {
+		return ret;
+	}
+
+	// the command is on the stack, it has to complete before return
+	if (wait_for_completion_interruptible(&done)) {
+		mcu_async_cancel(&command);
+		wait_for_completion(&done);
+		if (-ECANCELED == command.ret) {
+			return -ERESTARTSYS;
+		}
+	}
+	return command.ret;
+}
+
+/*
+ * send command to a device id and wait for the response,
+ * requests beyond the negotiated window wait for a free slot
+ */
+int mcu_bus_command(struct mcu_bus_device *bus, enum mcu_tx_class tx_class, mcu_device_id device_id, mcu_control_code cmd, unsigned char *buffer, int len, int timeout)
+{
+	return __mcu_bus_command(bus, tx_class, device_id, cmd, buffer, len, timeout, 0);
+}
+
+static unsigned int mcu_device_command_flags(struct mcu_device *device, mcu_control_code cmd)
+{
+	if (cmd && device->retry_codes && strchr(device->retry_codes, cmd)) {
+		return MCU_COMMAND_RETRY;
+	}
+	return 0;
+}
 
 /* send command with device */
 int mcu_device_command(struct mcu_device *device, mcu_control_code cmd, unsigned char *buffer, int len)
 {
-	struct mcu_packet *packet, *reply;
-	struct mcu_event *event;
-	int ret = 0;
+	return __mcu_bus_command(device->bus, device->tx_class, device->device_id, cmd, buffer, len, MCU_COMMAND_TIMEOUT, mcu_device_command_flags(device, cmd));
+}
 
-	packet = mcu_packet_send_control_request(device->bus, device->device_id, cmd, buffer, len);
-	if (unlikely(!packet)) {
-		return -EFAULT;
-	}
+/* same, in another transmit class than the one of the device */
+int mcu_device_command_class(struct mcu_device *device, enum mcu_tx_class tx_class, mcu_control_code cmd, unsigned char *buffer, int len)
+{
+	return __mcu_bus_command(device->bus, tx_class, device->device_id, cmd, buffer, len, MCU_COMMAND_TIMEOUT, mcu_device_command_flags(device, cmd));
+}
 
-	// wait for reply
-	event = mcu_wait_event(device->bus, packet, MCU_CONTROL_RESPONSE_DETECTED, 3000);
-	if (unlikely(!event)) {
-		ret = -ETIME;
-		goto exit_free_packet;
+int mcu_device_command_async(struct mcu_device *device, struct mcu_async_command *command)
+{
+	command->flags |= mcu_device_command_flags(device, command->cmd);
+	return mcu_bus_command_async(device->bus, device->tx_class, device->device_id, command);
+}
+
+void mcu_device_command_cancel(struct mcu_async_command *command)
+{
+	mcu_async_cancel(command);
+}
+
+/* send one frame of the batch and wait for the batch response */
+static int __mcu_device_command_batch(struct mcu_device *device, struct mcu_command *cmds, int *count)
+{
+	struct mcu_bus_device *bus = device->bus;
+	struct mcu_tx_frame *frame;
+	struct mcu_packet *reply;
+	ktime_t submitted;
+	unsigned int us;
+	int i, ret;
+
+	if (mcu_link_down(bus)) {
+		return -ENOLINK;
 	}
-	reply = (struct mcu_packet *)event->object;
-	ret = mcu_packet_copy_control_detail(reply, buffer, &len);
-	if (ret < 0) {
-		// error code
+	submitted = ktime_get();
+	ret = down_interruptible(&bus->tx_window);
+	if (ret) {
+		return ret;
+	}
+
+	frame = mcu_packet_send_batch_request(bus, device->tx_class, device->device_id, cmds, count);
+	if (IS_ERR(frame)) {
+		ret = PTR_ERR(frame);
+		goto exit_window;
 	}
-	else if (ret < len) {
-		// buffer too small
-		ret = -ENOSPC;
+	mcu_tx_flush(bus);
+
+	reply = mcu_packet_wait_response(frame, MCU_COMMAND_TIMEOUT);
+	if (IS_ERR(reply)) {
+		ret = PTR_ERR(reply);
+		if (-ETIME == ret) {
+			bus->stats.tx_timeouts++;
+			mcu_link_suspect(bus);
+		}
+		goto exit_free_frame;
 	}
-	else {
+	ret = mcu_packet_copy_batch_detail(reply, device->device_id, cmds, *count);
+	mcu_packet_put(reply);
+	// as asynchronous commands, from submission until the response is in
+	us = ktime_us_delta(ktime_get(), submitted);
+	for (i = 0; ret >= 0 && i < *count; i++) {
+		if (cmds[i].ret >= 0) {
+			mcu_latency_record(device, cmds[i].cmd, us);
+		}
 	}
-	mcu_free_event(event);
 
-exit_free_packet:
-	mcu_packet_free(packet);
+exit_free_frame:
+	mcu_tx_frame_free(frame);
+exit_window:
+	up(&bus->tx_window);
+	// asynchronous commands may wait for the slot
+	mcu_signal_event(bus, MCU_ASYNC_COMMAND);
 	return ret;
 }
 
-/* use ping to check availability of the peer mcu */
-int mcu_check_ping(struct mcu_device *device)
+/*
+ * commands are packed into as few batch frames as they fit,
+ * or sent one by one if the mcu does not support batches.
+ * return 0 or the error that stopped the batch, results are in cmds[].ret
+ */
+int mcu_device_command_batch(struct mcu_device *device, struct mcu_command *cmds, int count)
 {
-	struct mcu_packet *packet;
-	struct mcu_event *event;
-	int ret = 0;
+	int i, n, ret = 0;
+
+	if (!(device->bus->link_features & MCU_LINK_FEATURE_BATCH)) {
+		// all of them are sent, the first error is returned as a batch would stop there
+		for (i = 0; i < count; i++) {
+			cmds[i].ret = mcu_device_command(device, cmds[i].cmd, cmds[i].buffer, cmds[i].len);
+			if (cmds[i].ret < 0 && 0 == ret) {
+				ret = cmds[i].ret;
+			}
+		}
+		return ret;
+	}
 
-	packet = mcu_packet_send_ping(device->bus);
-	if (unlikely(!packet)) {
-		return -EFAULT;
+	for (i = 0; i < count; i += n) {
+		n = count - i;
+		ret = __mcu_device_command_batch(device, &cmds[i], &n);
+		if (ret < 0) {
+			break;
+		}
+	}
+	for (; i < count; i++) {
+		cmds[i].ret = ret;
 	}
 
-	// wait for reply
-	event = mcu_wait_event(device->bus, packet, MCU_PONG_DETECTED, 3000);
-	if (unlikely(!event)) {
-		ret = -ETIME;
-		goto exit_free_packet;
+	return ret;
+}
+
+/* ping the peer mcu, timeout in ms, sent again each time the urgent class times out */
+int mcu_bus_ping(struct mcu_bus_device *bus, int timeout)
+{
+	struct mcu_tx_frame *frame;
+	struct mcu_packet *reply;
+	ktime_t start, sent;
+	int attempt, wait, ret = -ETIME;
+
+	start = ktime_get();
+	for (attempt = 0; attempt < MCU_PING_ATTEMPTS; attempt++) {
+		wait = timeout - (int)ktime_to_ms(ktime_sub(ktime_get(), start));
+		if (wait <= 0) {
+			break;
+		}
+		// the last one waits for what is left of the timeout
+		if (attempt < MCU_PING_ATTEMPTS - 1) {
+			wait = min_t(int, wait, DIV_ROUND_UP(mcu_bus_rto(bus, MCU_TX_URGENT) << attempt, USEC_PER_MSEC));
+		}
+		if (attempt) {
+			bus->stats.tx_retransmits++;
+		}
+
+		frame = mcu_packet_send_ping(bus);
+		if (IS_ERR(frame)) {
+			return PTR_ERR(frame);
+		}
+		mcu_tx_flush(bus);
+		sent = ktime_get();
+
+		// wait for reply
+		reply = mcu_packet_wait_response(frame, wait);
+		mcu_tx_frame_free(frame);
+		if (!IS_ERR(reply)) {
+			if (0 == attempt) {
+				mcu_bus_rtt_sample(bus, MCU_TX_URGENT, ktime_us_delta(ktime_get(), sent));
+			}
+			mcu_packet_put(reply);
+			return 0;
+		}
+		ret = PTR_ERR(reply);
+		if (-ETIME != ret) {
+			break;
+		}
 	}
-	mcu_free_event(event);
 
-exit_free_packet:
-	mcu_packet_free(packet);
+	if (-ETIME == ret) {
+		bus->stats.tx_timeouts++;
+	}
 	return ret;
 }
 
+/* use ping to check availability of the peer mcu */
+int mcu_check_ping(struct mcu_device *device)
+{
+	return mcu_bus_ping(device->bus, MCU_COMMAND_TIMEOUT);
+}
+
+enum mcu_link_state mcu_device_link_state(struct mcu_device *device)
+{
+	return READ_ONCE(device->bus->link_state);
+}
+
+/* frames queued on the bus and their bytes, not completely written yet */
+int mcu_device_tx_pending(struct mcu_device *device, int *bytes)
+{
+	return mcu_tx_pending(device->bus, bytes);
+}
+
+/* the backend has room again, resume the transmit queue */
 void mcu_write_complete(struct mcu_bus_device *bus)
 {
-	mcu_queue_event(NULL, bus, MCU_WRITE_COMPLETE);
+	mcu_tx_flush(bus);
 }
 
 int mcu_receive(struct mcu_bus_device *bus, const unsigned char *cp, size_t count)
@@ -104,7 +288,10 @@ int mcu_receive(struct mcu_bus_device *bus, const unsigned char *cp, size_t coun
 		return -EFAULT;
 	}
 	ret = mcu_packet_receive_buffer(bus, cp, count);
-	mcu_queue_event(NULL, bus, MCU_DATA_RECEIVED);
+	// the worker takes over if it is detecting already or the budget ran out
+	if (!READ_ONCE(rx_direct) || mcu_packet_buffer_try_detect(bus)) {
+		mcu_signal_event(bus, MCU_DATA_RECEIVED);
+	}
 	return ret;
 }
 
@@ -117,40 +304,93 @@ struct device_type mcu_dev_type = {
 	.release	= mcu_dev_release,
 };
 
+/* mcu_device_srcu read locked or children_lock held, never sleeps */
 static struct mcu_device *mcu_find_device(struct mcu_bus_device *bus, mcu_device_id id)
+{
+	return srcu_dereference_check(bus->devices[id], &mcu_device_srcu, lockdep_is_held(&bus->children_lock));
+}
+
+/*
+ * children_lock is held only to take a reference, so callbacks may take their time,
+ * device_lock keeps the driver bound during the callback
+ */
+void mcu_bus_link_change(struct mcu_bus_device *bus, enum mcu_link_state state)
 {
 	struct mcu_device *device;
-	list_for_each_entry(device, &bus->children, node) {
-		if (device->device_id == id) {
-			return device;
+	struct mcu_driver *driver;
+	int id;
+
+	for (id = 0; id < MCU_BUS_DEVICES; id++) {
+		mutex_lock(&bus->children_lock);
+		device = mcu_find_device(bus, id);
+		if (device) {
+			get_device(&device->dev);
 		}
+		mutex_unlock(&bus->children_lock);
+		if (!device) {
+			continue;
+		}
+
+		device_lock(&device->dev);
+		if (device->dev.driver) {
+			driver = to_mcu_driver(device->dev.driver);
+			if (driver->link_change) {
+				driver->link_change(device, state);
+			}
+		}
+		device_unlock(&device->dev);
+		put_device(&device->dev);
 	}
-	return NULL;
+}
+
+void mcu_bus_latency_record(struct mcu_bus_device *bus, mcu_device_id id, mcu_control_code code, unsigned int us)
+{
+	struct mcu_device *device;
+	int idx;
+
+	idx = srcu_read_lock(&mcu_device_srcu);
+	device = mcu_find_device(bus, id);
+	if (device) {
+		mcu_latency_record(device, code, us);
+	}
+	srcu_read_unlock(&mcu_device_srcu, idx);
 }
 
 static void mcu_handle_request(struct mcu_bus_device *bus, struct mcu_packet *packet)
 {
 	struct mcu_device *device;
+	struct device_driver *drv;
 	struct mcu_driver *driver;
 	mcu_device_id device_id;
 	mcu_control_code control_code;
-	int detail_len;
-	unsigned char *p = (unsigned char *)packet;
+	int detail_len, idx;
 
 	if (mcu_packet_extract_control_info(packet, &device_id, &control_code, &detail_len) < 0) {
 		return;
 	}
 
+	idx = srcu_read_lock(&mcu_device_srcu);
 	device = mcu_find_device(bus, device_id);
 	if (!device) {
-		return;
+#ifdef CONFIG_MCU_DEV
+		// no kernel driver, userspace may have claimed the id
+		mcu_dev_report(bus, device_id, control_code, mcu_packet_control_detail(packet), detail_len);
+#endif
+		goto exit_unlock;
 	}
 
-	driver = to_mcu_driver(device->dev.driver);
+	drv = READ_ONCE(device->dev.driver);
+	if (!drv) {
+		goto exit_unlock;
+	}
+	driver = to_mcu_driver(drv);
 
-	if (driver && driver->report) {
-		driver->report(device, control_code, &p[MCU_PACKET_DETAIL_OFFSET], detail_len);
+	if (driver->report) {
+		driver->report(device, control_code, mcu_packet_control_detail(packet), detail_len);
 	}
+
+exit_unlock:
+	srcu_read_unlock(&mcu_device_srcu, idx);
 }
 
 struct mcu_device *mcu_new_device(struct mcu_bus_device *bus, struct mcu_board_info const *info)
@@ -158,14 +398,19 @@ struct mcu_device *mcu_new_device(struct mcu_bus_device *bus, struct mcu_board_i
 	struct mcu_device *device;
 	int ret;
 
+	// held until the device is in the table, so the id is taken once only
+	mutex_lock(&bus->children_lock);
 	if (mcu_find_device(bus, info->device_id)) {
+		mutex_unlock(&bus->children_lock);
 		dev_err(&bus->dev, "id[%d] on bus [%s] already exists", info->device_id, bus->name);
 		return NULL;
 	}
 
-	device = kzalloc(sizeof(struct mcu_bus_device), GFP_KERNEL);
-	if (!device)
+	device = kzalloc(sizeof(struct mcu_device), GFP_KERNEL);
+	if (!device) {
+		mutex_unlock(&bus->children_lock);
 		return NULL;
+	}
 
 	device->dev.platform_data = info->platform_data;
 	device->device_id = info->device_id;
@@ -180,17 +425,33 @@ struct mcu_device *mcu_new_device(struct mcu_bus_device *bus, struct mcu_board_i
 	if (ret)
 		goto reg_err;
 
+	mcu_debugfs_add_device(device);
 	list_add_tail(&device->node, &bus->children);
+	rcu_assign_pointer(bus->devices[device->device_id], device);
+	mutex_unlock(&bus->children_lock);
 	dev_dbg(&bus->dev, "device [%s] registered with bus id %s\n", device->name, dev_name(&device->dev));
 	return device;
 
 reg_err:
+	mutex_unlock(&bus->children_lock);
 	kfree(device);
 	return NULL;
 }
 
+/* no report is delivered to the device once this returns, not from a report callback */
 void mcu_unregister_device(struct mcu_device *device)
 {
+	struct mcu_bus_device *bus = device->bus;
+
+	mutex_lock(&bus->children_lock);
+	if (rcu_access_pointer(bus->devices[device->device_id]) == device) {
+		RCU_INIT_POINTER(bus->devices[device->device_id], NULL);
+		list_del(&device->node);
+	}
+	mutex_unlock(&bus->children_lock);
+
+	synchronize_srcu(&mcu_device_srcu);
+	mcu_debugfs_remove_device(device);
 	device_unregister(&device->dev);
 }
 
@@ -206,7 +467,129 @@ static void mcu_bus_dev_release(struct device *dev)
 	complete(&bus->dev_released);
 }
 
+#define MCU_BUS_STAT_ATTR(_name)	\
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf)	\
+{	\
+	return sprintf(buf, "%lu\n", (unsigned long)to_mcu_bus_device(dev)->stats._name);	\
+}	\
+static DEVICE_ATTR_RO(_name)
+
+MCU_BUS_STAT_ATTR(rx_fifo_size);
+MCU_BUS_STAT_ATTR(rx_fifo_high_watermark);
+MCU_BUS_STAT_ATTR(rx_overrun_bytes);
+MCU_BUS_STAT_ATTR(rx_packet_dropped);
+MCU_BUS_STAT_ATTR(rx_transfer_dropped);
+MCU_BUS_STAT_ATTR(rx_response_unmatched);
+MCU_BUS_STAT_ATTR(rx_polls);
+MCU_BUS_STAT_ATTR(rx_poll_frames);
+MCU_BUS_STAT_ATTR(rx_poll_frames_max);
+MCU_BUS_STAT_ATTR(rx_poll_exhausted);
+MCU_BUS_STAT_ATTR(rx_direct_polls);
+MCU_BUS_STAT_ATTR(tx_frame_exhausted);
+MCU_BUS_STAT_ATTR(tx_queue_size);
+MCU_BUS_STAT_ATTR(tx_queue_depth);
+MCU_BUS_STAT_ATTR(tx_queue_bytes);
+MCU_BUS_STAT_ATTR(tx_queue_full);
+MCU_BUS_STAT_ATTR(tx_frames);
+MCU_BUS_STAT_ATTR(tx_writes);
+MCU_BUS_STAT_ATTR(tx_retransmits);
+MCU_BUS_STAT_ATTR(tx_window);
+MCU_BUS_STAT_ATTR(baud);
+MCU_BUS_STAT_ATTR(link_downs);
+
+/* per transmit class counters, as _name_class */
+#define MCU_BUS_CLASS_STAT_ATTR(_name, _class, _index)	\
+static ssize_t _name##_##_class##_show(struct device *dev, struct device_attribute *attr, char *buf)	\
+{	\
+	return sprintf(buf, "%lu\n", (unsigned long)to_mcu_bus_device(dev)->stats._name[_index]);	\
+}	\
+static DEVICE_ATTR_RO(_name##_##_class)
+
+MCU_BUS_CLASS_STAT_ATTR(tx_latency, urgent, MCU_TX_URGENT);
+MCU_BUS_CLASS_STAT_ATTR(tx_latency, normal, MCU_TX_NORMAL);
+MCU_BUS_CLASS_STAT_ATTR(tx_latency, bulk, MCU_TX_BULK);
+MCU_BUS_CLASS_STAT_ATTR(tx_latency_max, urgent, MCU_TX_URGENT);
+MCU_BUS_CLASS_STAT_ATTR(tx_latency_max, normal, MCU_TX_NORMAL);
+MCU_BUS_CLASS_STAT_ATTR(tx_latency_max, bulk, MCU_TX_BULK);
+MCU_BUS_CLASS_STAT_ATTR(rtt, urgent, MCU_TX_URGENT);
+MCU_BUS_CLASS_STAT_ATTR(rtt, normal, MCU_TX_NORMAL);
+MCU_BUS_CLASS_STAT_ATTR(rtt, bulk, MCU_TX_BULK);
+MCU_BUS_CLASS_STAT_ATTR(rtt_var, urgent, MCU_TX_URGENT);
+MCU_BUS_CLASS_STAT_ATTR(rtt_var, normal, MCU_TX_NORMAL);
+MCU_BUS_CLASS_STAT_ATTR(rtt_var, bulk, MCU_TX_BULK);
+MCU_BUS_CLASS_STAT_ATTR(rto, urgent, MCU_TX_URGENT);
+MCU_BUS_CLASS_STAT_ATTR(rto, normal, MCU_TX_NORMAL);
+MCU_BUS_CLASS_STAT_ATTR(rto, bulk, MCU_TX_BULK);
+
+static struct attribute *mcu_bus_stat_attrs[] = {
+	&dev_attr_rx_fifo_size.attr,
+	&dev_attr_rx_fifo_high_watermark.attr,
+	&dev_attr_rx_overrun_bytes.attr,
+	&dev_attr_rx_packet_dropped.attr,
+	&dev_attr_rx_transfer_dropped.attr,
+	&dev_attr_rx_response_unmatched.attr,
+	&dev_attr_rx_polls.attr,
+	&dev_attr_rx_poll_frames.attr,
+	&dev_attr_rx_poll_frames_max.attr,
+	&dev_attr_rx_poll_exhausted.attr,
+	&dev_attr_rx_direct_polls.attr,
+	&dev_attr_tx_frame_exhausted.attr,
+	&dev_attr_tx_queue_size.attr,
+	&dev_attr_tx_queue_depth.attr,
+	&dev_attr_tx_queue_bytes.attr,
+	&dev_attr_tx_queue_full.attr,
+	&dev_attr_tx_frames.attr,
+	&dev_attr_tx_writes.attr,
+	&dev_attr_tx_latency_urgent.attr,
+	&dev_attr_tx_latency_normal.attr,
+	&dev_attr_tx_latency_bulk.attr,
+	&dev_attr_tx_latency_max_urgent.attr,
+	&dev_attr_tx_latency_max_normal.attr,
+	&dev_attr_tx_latency_max_bulk.attr,
+	&dev_attr_rtt_urgent.attr,
+	&dev_attr_rtt_normal.attr,
+	&dev_attr_rtt_bulk.attr,
+	&dev_attr_rtt_var_urgent.attr,
+	&dev_attr_rtt_var_normal.attr,
+	&dev_attr_rtt_var_bulk.attr,
+	&dev_attr_rto_urgent.attr,
+	&dev_attr_rto_normal.attr,
+	&dev_attr_rto_bulk.attr,
+	&dev_attr_tx_retransmits.attr,
+	&dev_attr_tx_window.attr,
+	&dev_attr_baud.attr,
+	&dev_attr_link_downs.attr,
+	NULL,
+};
+
+static const struct attribute_group mcu_bus_stat_group = {
+	.name	= "statistics",
+	.attrs	= mcu_bus_stat_attrs,
+};
+
+static ssize_t link_state_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", mcu_link_state_name(READ_ONCE(to_mcu_bus_device(dev)->link_state)));
+}
+static DEVICE_ATTR_RO(link_state);
+
+static struct attribute *mcu_bus_attrs[] = {
+	&dev_attr_link_state.attr,
+	NULL,
+};
+
+static const struct attribute_group mcu_bus_group = {
+	.attrs	= mcu_bus_attrs,
+};
+
+static const struct attribute_group *mcu_bus_dev_groups[] = {
+	&mcu_bus_group,
+	&mcu_bus_stat_group,
+	NULL,
+};
+
 struct device_type mcu_bus_dev_type = {
+	.groups	= mcu_bus_dev_groups,
 	.release	= mcu_bus_dev_release,
 };
 
@@ -241,46 +624,135 @@ static void of_mcu_register_devices(struct mcu_bus_device *bus)
 static void of_mcu_register_devices(struct mcu_bus_device *dev) {}
 #endif
 
-static int __mcu_packet_write(struct mcu_bus_device *bus, const void *cp, int count)
+static int __mcu_packet_write(struct mcu_bus_device *bus, const void *cp, int count, enum mcu_tx_class tx_class, int timeout)
 {
-	if (!bus || !bus->do_write) {
+	if (!bus) {
 		return -EINVAL;
 	}
-	return bus->do_write(bus, cp, count);
+	return mcu_tx_queue_frame(bus, cp, count, tx_class, timeout);
 }
 
-static void __mcu_packet_ping(struct mcu_bus_device *bus, struct mcu_packet *packet)
+/* the queued event owns a reference of the packet */
+static void __mcu_packet_queue(struct mcu_bus_device *bus, struct mcu_packet *packet, enum mcu_event_type type)
 {
-	mcu_queue_event(packet, bus, MCU_PING_DETECTED);
-}
+	struct mcu_event *event = mcu_packet_event(packet);
 
-static void __mcu_packet_pong(struct mcu_bus_device *bus, struct mcu_packet *packet)
-{
-	mcu_queue_event(packet, bus, MCU_PONG_DETECTED);
+	event->type = type;
+	event->object = mcu_packet_get(packet);
+	event->bus = bus;
+	mcu_queue_event(event);
 }
 
-static void __mcu_packet_new_request(struct mcu_bus_device *bus, struct mcu_packet *packet)
+/* answered right away, queuing the pong never waits for room */
+static void __mcu_packet_ping(struct mcu_bus_device *bus, struct mcu_packet *packet)
 {
-	mcu_queue_event(packet, bus, MCU_CONTROL_REQUEST_DETECTED);
+	struct mcu_tx_frame *frame = mcu_packet_send_pong(bus);
+	if (!IS_ERR(frame)) {
+		mcu_tx_frame_free(frame);
+	}
 }
 
-static void __mcu_packet_new_response(struct mcu_bus_device *bus, struct mcu_packet *packet)
+static void __mcu_packet_new_request(struct mcu_bus_device *bus, struct mcu_packet *packet)
 {
-	mcu_queue_event(packet, bus, MCU_CONTROL_RESPONSE_DETECTED);
+	__mcu_packet_queue(bus, packet, MCU_CONTROL_REQUEST_DETECTED);
 }
 
 static struct mcu_packet_callback __packet_callback = {
 	.write	= __mcu_packet_write,
 	.ping	= __mcu_packet_ping,
-	.pong	= __mcu_packet_pong,
 	.new_request	= __mcu_packet_new_request,
-	.new_response	= __mcu_packet_new_response,
 };
 
+static void mcu_handle_events(struct mcu_bus_device *bus);
+
+/*
+ * every bus has a worker of its own so a slow bus does not hold back the others,
+ * a kthread as late_init may open files
+ */
+static int mcu_bus_worker(void *data)
+{
+	struct mcu_bus_device *bus = data;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		// checked again once the state is set, kthread_stop() may have woken us before
+		if (kthread_should_stop()) {
+			break;
+		}
+		if (!mcu_event_pending(bus)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		mcu_handle_events(bus);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+/* cpu and priority of the worker are optional, from lbs,worker-cpu and lbs,worker-priority */
+static int mcu_bus_worker_start(struct mcu_bus_device *bus)
+{
+	struct sched_param param;
+	struct task_struct *task;
+	u32 cpu, priority;
+
+	task = kthread_create(mcu_bus_worker, bus, "mcu%d", bus->nr);
+	if (IS_ERR(task)) {
+		return PTR_ERR(task);
+	}
+
+	if (0 == of_property_read_u32(bus->dev.of_node, "lbs,worker-cpu", &cpu)) {
+		if (cpu < nr_cpu_ids && cpu_online(cpu)) {
+			kthread_bind(task, cpu);
+		}
+		else {
+			dev_warn(&bus->dev, "worker cpu %u not available\n", cpu);
+		}
+	}
+	// SCHED_FIFO priority, 0 keeps SCHED_NORMAL
+	if (0 == of_property_read_u32(bus->dev.of_node, "lbs,worker-priority", &priority) && priority > 0) {
+		param.sched_priority = min(priority, (u32)(MAX_USER_RT_PRIO - 1));
+		sched_setscheduler_nocheck(task, SCHED_FIFO, &param);
+	}
+
+	rcu_assign_pointer(bus->event_task, task);
+	wake_up_process(task);
+	return 0;
+}
+
+/* events left are dropped, they may hold packets of the bus */
+static void mcu_bus_worker_stop(struct mcu_bus_device *bus)
+{
+	struct task_struct *task;
+	struct mcu_event *event, *next;
+	struct llist_node *events;
+
+	task = rcu_dereference_protected(bus->event_task, 1);
+	RCU_INIT_POINTER(bus->event_task, NULL);
+	// nobody wakes the worker after this
+	synchronize_rcu();
+
+	if (task) {
+		kthread_stop(task);
+	}
+	events = mcu_get_events(bus);
+	llist_for_each_entry_safe(event, next, events, llnode) {
+		mcu_free_event(event);
+	}
+	bus->event_flags = 0;
+}
+
 int mcu_register_bus_device(struct mcu_bus_device *bus)
 {
-	int ret;
+	int i, ret;
 	INIT_LIST_HEAD(&bus->children);
+	mutex_init(&bus->children_lock);
+	for (i = 0; i < MCU_BUS_DEVICES; i++) {
+		RCU_INIT_POINTER(bus->devices[i], NULL);
+	}
+	init_completion(&bus->dev_released);
 	dev_set_name(&bus->dev, "mcu-%d", bus->nr);
 	bus->dev.bus = &mcu_bus_type;
 	bus->dev.type = &mcu_bus_dev_type;
@@ -290,12 +762,43 @@ int mcu_register_bus_device(struct mcu_bus_device *bus)
 
 	dev_dbg(&bus->dev, "bus [%d] registered\n", bus->nr);
 
-	spin_lock_init(&bus->event_lock);
-	init_waitqueue_head(&bus->wait_queue);
-	INIT_LIST_HEAD(&bus->event_list);
+	init_llist_head(&bus->event_queue);
+	bus->event_flags = 0;
+	mcu_link_init(bus);
+	mcu_async_init(bus);
+
+	ret = mcu_tx_init(bus);
+	if (ret) {
+		dev_err(&bus->dev, "failed to init transmit queue: ret=%d\n", ret);
+		device_unregister(&bus->dev);
+		goto out;
+	}
+
+	ret = mcu_packet_init(bus, &__packet_callback);
+	if (ret) {
+		dev_err(&bus->dev, "failed to init packet layer: ret=%d\n", ret);
+		mcu_tx_deinit(bus);
+		device_unregister(&bus->dev);
+		goto out;
+	}
 
-	mcu_packet_init(bus, &__packet_callback);
-	mcu_queue_event(NULL, bus, MCU_LATE_INIT);
+	ret = mcu_bus_worker_start(bus);
+	if (ret) {
+		dev_err(&bus->dev, "failed to start worker: ret=%d\n", ret);
+		mcu_packet_deinit(bus);
+		mcu_tx_deinit(bus);
+		device_unregister(&bus->dev);
+		goto out;
+	}
+	mcu_debugfs_add_bus(bus);
+#ifdef CONFIG_MCU_DEV
+	ret = mcu_dev_add_bus(bus);
+	if (ret) {
+		// the bus works without
+		dev_warn(&bus->dev, "failed to add control channel: ret=%d\n", ret);
+	}
+#endif
+	mcu_signal_event(bus, MCU_LATE_INIT);
 	of_mcu_register_devices(bus);
 	return 0;
 
@@ -321,14 +824,30 @@ int mcu_add_bus_device(struct mcu_bus_device *bus)
 
 void mcu_remove_bus_device(struct mcu_bus_device *bus)
 {
-	struct mcu_device *d, *_n;
-
-	list_for_each_entry_safe(d, _n, &bus->children, node) {
-		list_del(&d->node);
+	struct mcu_device *d;
+
+	// drivers may still talk to the mcu while removed, the worker is needed
+	while (1) {
+		mutex_lock(&bus->children_lock);
+		d = list_first_entry_or_null(&bus->children, struct mcu_device, node);
+		mutex_unlock(&bus->children_lock);
+		if (!d) {
+			break;
+		}
 		mcu_remove_device(d);
 	}
 
+	mcu_debugfs_remove_bus(bus);
+	mcu_link_stop(bus);
+	mcu_bus_worker_stop(bus);
+	mcu_link_deinit(bus);
+#ifdef CONFIG_MCU_DEV
+	// before the commands of its files fail
+	mcu_dev_remove_bus(bus);
+#endif
+	mcu_async_deinit(bus);
 	mcu_packet_deinit(bus);
+	mcu_tx_deinit(bus);
 }
 
 static int mcu_do_add_bus(struct mcu_driver *driver, struct mcu_bus_device *bus)
@@ -380,58 +899,47 @@ void mcu_unregister_driver(struct mcu_driver *drv)
 	driver_unregister(&drv->driver);
 }
 
-static void mcu_handle_event(struct work_struct *work)
+static void mcu_handle_events(struct mcu_bus_device *bus)
 {
-	struct mcu_event *event;
-	struct mcu_packet *packet;
-	int do_free = 1;
-
-#define NOTIFY_EVENT(e)	do {	\
-		mcu_notify_event(e);	\
-		do_free = 0;	\
-	} while (0)
-
-	mutex_lock(&mcu_mutex);
+	struct mcu_event *event, *next;
+	struct llist_node *events;
+
+	if (mcu_test_event(bus, MCU_LATE_INIT)) {
+		if (0 == bus->late_init(bus)) {
+			// frames queued before the backend was ready
+			mcu_tx_flush(bus);
+			mcu_link_start(bus);
+		}
+	}
+	/*
+	 * packets detected are queued as events of their own,
+	 * receive notifications coalesce in the flag until the next poll,
+	 * a poll out of budget polls again after the events queued so far
+	 */
+	if (mcu_test_event(bus, MCU_DATA_RECEIVED)) {
+		if (mcu_packet_buffer_detect(bus)) {
+			mcu_signal_event(bus, MCU_DATA_RECEIVED);
+		}
+	}
+	// after detecting, so responses just in complete their commands right away
+	if (mcu_test_event(bus, MCU_ASYNC_COMMAND)) {
+		mcu_async_handle(bus);
+	}
 
-	while ((event = mcu_get_event())) {
+	events = mcu_get_events(bus);
+	llist_for_each_entry_safe(event, next, events, llnode) {
 		switch (event->type) {
-		case MCU_WRITE_COMPLETE:
-			//NOTIFY_EVENT(event);
-			break;
-		case MCU_DATA_RECEIVED:
-			mcu_packet_buffer_detect(event->bus);
-			break;
-		case MCU_PING_DETECTED:
-			packet = mcu_packet_send_pong(event->bus);
-			if (likely(packet))
-				mcu_packet_free(packet);
-			break;
-		case MCU_PONG_DETECTED:
-			NOTIFY_EVENT(event);
-			break;
 		case MCU_CONTROL_REQUEST_DETECTED:
-			mcu_handle_request(event->bus, event->object);
+			mcu_handle_request(bus, event->object);
 			break;
-		case MCU_CONTROL_RESPONSE_DETECTED:
-			NOTIFY_EVENT(event);
-			break;
-		case MCU_LATE_INIT:
-			event->bus->late_init(event->bus);
+		default:
 			break;
 		}
 
-		//mcu_remove_duplicate_events(event->object, event->type);
-		if (do_free) {
-			mcu_free_event(event);
-		}
-		do_free = 1;
+		mcu_free_event(event);
 	}
-
-	mutex_unlock(&mcu_mutex);
 }
 
-DECLARE_WORK(mcu_event_work, mcu_handle_event);
-
 
 static const struct mcu_device_id *mcu_match_id(const struct mcu_device_id *id, const struct mcu_device *device)
 {
@@ -478,6 +986,8 @@ static int mcu_driver_probe(struct device *dev)
 	if (!driver || !driver->probe)
 		return -ENODEV;
 
+	device->tx_class = driver->tx_class;
+	device->retry_codes = driver->retry_codes;
 	// TODO: should find the index of driver->id_table
 	ret = driver->probe(device, driver->id_table);
 	return ret;
@@ -533,6 +1043,7 @@ static int __init mcu_init(void)
 		pr_err("Failed to register mcu bus, error=%d\n", ret);
 		return ret;
 	}
+	mcu_debugfs_init();
 
 #ifdef CONFIG_MCU_LDISC
 	sermcu_init();
@@ -564,9 +1075,8 @@ static void __exit mcu_exit(void)
 	sermcu_exit();
 #endif
 
+	mcu_debugfs_exit();
 	bus_unregister(&mcu_bus_type);
-
-	//cancel_work_sync(&mcu_event_work);
 }
 
 module_init(mcu_init);
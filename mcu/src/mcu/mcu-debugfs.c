@@ -0,0 +1,264 @@
+/*
+ * mcu-debugfs.c
+ * mcu coprocessor bus protocol, debugfs statistics
+ *
+ * Author: Alex.wang
+ * Create: 2015-08-29 10:12
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include "mcu-internal.h"
+
+/*
+ * mcu/mcu-N/stats		counters of the bus
+ * mcu/mcu-N/<device>/latency	command latency histogram per control code used
+ */
+static struct dentry *mcu_debugfs_root;
+
+#define MCU_STAT(s, stats, _name)	\
+	seq_printf(s, "%-24s %lu\n", #_name, (unsigned long)(stats)->_name)
+
+#define MCU_CLASS_STAT(s, stats, _name)	\
+	seq_printf(s, "%-24s %lu %lu %lu\n", #_name, (unsigned long)(stats)->_name[MCU_TX_URGENT],	\
+		(unsigned long)(stats)->_name[MCU_TX_NORMAL], (unsigned long)(stats)->_name[MCU_TX_BULK])
+
+static int mcu_debugfs_stats_show(struct seq_file *s, void *unused)
+{
+	struct mcu_bus_device *bus = s->private;
+	struct mcu_bus_stats *stats = &bus->stats;
+
+	MCU_STAT(s, stats, rx_bytes);
+	MCU_STAT(s, stats, rx_frames);
+	MCU_STAT(s, stats, rx_header_errors);
+	MCU_STAT(s, stats, rx_checksum_errors);
+	MCU_STAT(s, stats, rx_resync_bytes);
+	MCU_STAT(s, stats, rx_fifo_size);
+	MCU_STAT(s, stats, rx_fifo_high_watermark);
+	MCU_STAT(s, stats, rx_overrun_bytes);
+	MCU_STAT(s, stats, rx_packet_dropped);
+	MCU_STAT(s, stats, rx_transfer_dropped);
+	MCU_STAT(s, stats, rx_response_unmatched);
+	MCU_STAT(s, stats, rx_polls);
+	MCU_STAT(s, stats, rx_poll_frames);
+	MCU_STAT(s, stats, rx_poll_frames_max);
+	MCU_STAT(s, stats, rx_poll_exhausted);
+	MCU_STAT(s, stats, rx_direct_polls);
+	MCU_STAT(s, stats, tx_frame_exhausted);
+	MCU_STAT(s, stats, tx_queue_size);
+	MCU_STAT(s, stats, tx_queue_depth);
+	MCU_STAT(s, stats, tx_queue_bytes);
+	MCU_STAT(s, stats, tx_queue_full);
+	MCU_STAT(s, stats, tx_frames);
+	MCU_STAT(s, stats, tx_bytes);
+	MCU_STAT(s, stats, tx_writes);
+	MCU_STAT(s, stats, tx_retransmits);
+	MCU_STAT(s, stats, tx_timeouts);
+	MCU_STAT(s, stats, tx_window);
+	MCU_STAT(s, stats, baud);
+	MCU_STAT(s, stats, link_downs);
+	seq_printf(s, "%-24s %s\n", "link_state", mcu_link_state_name(READ_ONCE(bus->link_state)));
+	// urgent, normal and bulk
+	MCU_CLASS_STAT(s, stats, tx_latency);
+	MCU_CLASS_STAT(s, stats, tx_latency_max);
+	MCU_CLASS_STAT(s, stats, rtt);
+	MCU_CLASS_STAT(s, stats, rtt_var);
+	MCU_CLASS_STAT(s, stats, rto);
+	return 0;
+}
+
+static int mcu_debugfs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mcu_debugfs_stats_show, inode->i_private);
+}
+
+static const struct file_operations mcu_debugfs_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mcu_debugfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void __mcu_debugfs_latency_line(struct seq_file *s, struct mcu_latency *latency, int slot)
+{
+	unsigned int count[MCU_LATENCY_BUCKETS];
+	int cpu, i;
+
+	memset(count, 0, sizeof(count));
+	for_each_possible_cpu(cpu) {
+		struct mcu_latency_histogram *h = per_cpu_ptr(latency->histogram, cpu);
+		for (i = 0; i < MCU_LATENCY_BUCKETS; i++) {
+			count[i] += h->count[slot][i];
+		}
+	}
+	for (i = 0; i < MCU_LATENCY_BUCKETS; i++) {
+		seq_printf(s, " %u", count[i]);
+	}
+	seq_putc(s, '\n');
+}
+
+/* a line per control code answered at least once, counts summed over cpus */
+static int mcu_debugfs_latency_show(struct seq_file *s, void *unused)
+{
+	struct mcu_device *device = s->private;
+	struct mcu_latency *latency = device->latency;
+	int code, slot, i;
+
+	seq_puts(s, "code");
+	for (i = 0; i < MCU_LATENCY_BUCKETS - 1; i++) {
+		seq_printf(s, " <%uus", 1U << (MCU_LATENCY_SHIFT + i));
+	}
+	seq_puts(s, " more\n");
+
+	for (code = 0; code < 256; code++) {
+		slot = READ_ONCE(latency->slot[code]) - 1;
+		if (slot < 0 || MCU_LATENCY_OTHER == slot) {
+			continue;
+		}
+		seq_printf(s, "0x%02x", code);
+		__mcu_debugfs_latency_line(s, latency, slot);
+	}
+	if (READ_ONCE(latency->nr_slots) > MCU_LATENCY_OTHER) {
+		seq_puts(s, "other");
+		__mcu_debugfs_latency_line(s, latency, MCU_LATENCY_OTHER);
+	}
+	return 0;
+}
+
+static int mcu_debugfs_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mcu_debugfs_latency_show, inode->i_private);
+}
+
+static const struct file_operations mcu_debugfs_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mcu_debugfs_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* the first answer of a code takes the next slot, or the shared one once they ran out */
+static int __mcu_latency_slot(struct mcu_latency *latency, mcu_control_code code)
+{
+	unsigned long flags;
+	int slot;
+
+	spin_lock_irqsave(&latency->lock, flags);
+	slot = latency->slot[code];
+	if (!slot) {
+		slot = min(latency->nr_slots, MCU_LATENCY_OTHER) + 1;
+		if (latency->nr_slots <= MCU_LATENCY_OTHER) {
+			latency->nr_slots++;
+		}
+		WRITE_ONCE(latency->slot[code], slot);
+	}
+	spin_unlock_irqrestore(&latency->lock, flags);
+
+	return slot;
+}
+
+/* never sleeps, a counter of this cpu is bumped */
+void mcu_latency_record(struct mcu_device *device, mcu_control_code code, unsigned int us)
+{
+	struct mcu_latency *latency = device->latency;
+	int bucket = 0, slot;
+
+	if (unlikely(!latency)) {
+		return;
+	}
+	slot = READ_ONCE(latency->slot[code]);
+	if (unlikely(!slot)) {
+		slot = __mcu_latency_slot(latency, code);
+	}
+	if (us >> MCU_LATENCY_SHIFT) {
+		bucket = min(ilog2(us) - MCU_LATENCY_SHIFT + 1, MCU_LATENCY_BUCKETS - 1);
+	}
+	this_cpu_inc(latency->histogram->count[slot - 1][bucket]);
+}
+
+static struct mcu_latency *__mcu_latency_alloc(void)
+{
+	struct mcu_latency *latency;
+
+	latency = kzalloc(sizeof(*latency), GFP_KERNEL);
+	if (!latency) {
+		return NULL;
+	}
+	spin_lock_init(&latency->lock);
+	latency->histogram = alloc_percpu(struct mcu_latency_histogram);
+	if (!latency->histogram) {
+		kfree(latency);
+		return NULL;
+	}
+	return latency;
+}
+
+static void __mcu_latency_free(struct mcu_latency *latency)
+{
+	if (latency) {
+		free_percpu(latency->histogram);
+		kfree(latency);
+	}
+}
+
+void mcu_debugfs_add_device(struct mcu_device *device)
+{
+	struct mcu_bus_device *bus = device->bus;
+
+	// statistics are optional, the device works without
+	device->latency = __mcu_latency_alloc();
+	if (!device->latency) {
+		dev_warn(&device->dev, "no memory for latency histogram\n");
+		return;
+	}
+	if (IS_ERR_OR_NULL(bus->debugfs)) {
+		return;
+	}
+	device->debugfs = debugfs_create_dir(dev_name(&device->dev), bus->debugfs);
+	if (!IS_ERR_OR_NULL(device->debugfs)) {
+		debugfs_create_file("latency", 0444, device->debugfs, device, &mcu_debugfs_latency_fops);
+	}
+}
+
+void mcu_debugfs_remove_device(struct mcu_device *device)
+{
+	debugfs_remove_recursive(device->debugfs);
+	device->debugfs = NULL;
+	__mcu_latency_free(device->latency);
+	device->latency = NULL;
+}
+
+void mcu_debugfs_add_bus(struct mcu_bus_device *bus)
+{
+	bus->debugfs = NULL;
+	if (IS_ERR_OR_NULL(mcu_debugfs_root)) {
+		return;
+	}
+	bus->debugfs = debugfs_create_dir(dev_name(&bus->dev), mcu_debugfs_root);
+	if (!IS_ERR_OR_NULL(bus->debugfs)) {
+		debugfs_create_file("stats", 0444, bus->debugfs, bus, &mcu_debugfs_stats_fops);
+	}
+}
+
+void mcu_debugfs_remove_bus(struct mcu_bus_device *bus)
+{
+	debugfs_remove_recursive(bus->debugfs);
+	bus->debugfs = NULL;
+}
+
+void __init mcu_debugfs_init(void)
+{
+	mcu_debugfs_root = debugfs_create_dir("mcu", NULL);
+}
+
+void mcu_debugfs_exit(void)
+{
+	debugfs_remove_recursive(mcu_debugfs_root);
+	mcu_debugfs_root = NULL;
+}
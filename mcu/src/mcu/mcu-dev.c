@@ -0,0 +1,553 @@
+/*
+ * mcu-dev.c
+ * mcu coprocessor bus protocol, raw control channel /dev/mcuN
+ *
+ * Author: Alex.wang
+ * Create: 2015-09-05 15:31
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/mcudev.h>
+#include "mcu-internal.h"
+
+/* reports queued for a file that does not read them are dropped */
+#define MCU_DEV_REPORTS_MAX	64
+
+/* one per bus, kept until the last file is closed */
+struct mcu_dev {
+	struct kref ref;
+	// NULL once the bus is gone, protected by lock
+	struct mcu_bus_device *bus;
+	struct mutex lock;
+	struct miscdevice misc;
+	char name[16];
+	// files receiving reports by device id
+	struct mcu_dev_file *claims[MCU_BUS_DEVICES];
+	spinlock_t claim_lock;
+};
+
+struct mcu_dev_file {
+	struct mcu_dev *dev;
+	wait_queue_head_t wait;
+	// requests in flight, completed and not reaped yet, reports not read yet
+	spinlock_t lock;
+	struct list_head pending;
+	struct list_head done;
+	struct list_head reports;
+	int nr_requests;
+	int nr_reports;
+};
+
+struct mcu_dev_request {
+	struct mcu_async_command command;
+	struct mcu_dev_file *file;
+	struct list_head node;
+	u64 buffer;
+	u64 user_data;
+	mcu_device_id device_id;
+	unsigned char data[0];
+};
+
+struct mcu_dev_report {
+	struct list_head node;
+	struct mcudev_report report;
+};
+
+static void mcu_dev_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct mcu_dev, ref));
+}
+
+/* called from the bus worker, or on bus removal */
+static void mcu_dev_complete(struct mcu_async_command *command)
+{
+	struct mcu_dev_request *request = command->context;
+	struct mcu_dev_file *file = request->file;
+	unsigned long flags;
+
+	spin_lock_irqsave(&file->lock, flags);
+	list_move_tail(&request->node, &file->done);
+	// release frees the file as soon as it sees pending empty, wake it before letting go
+	wake_up(&file->wait);
+	spin_unlock_irqrestore(&file->lock, flags);
+}
+
+static int mcu_dev_submit_one(struct mcu_dev_file *file, const struct mcudev_request *req)
+{
+	struct mcu_dev *dev = file->dev;
+	struct mcu_dev_request *request;
+	unsigned long flags;
+	int ret;
+
+	// reserved for later extensions
+	if ((req->flags & ~MCUDEV_RETRY) || req->reserved) {
+		return -EINVAL;
+	}
+	if (req->len > MCUDEV_LEN_MAX || req->tx_class >= MCU_TX_CLASSES || req->timeout > INT_MAX) {
+		return -EINVAL;
+	}
+
+	request = kmalloc(sizeof(*request) + req->len, GFP_KERNEL);
+	if (!request) {
+		return -ENOMEM;
+	}
+	if (copy_from_user(request->data, (const void __user *)(uintptr_t)req->buffer, req->len)) {
+		ret = -EFAULT;
+		goto exit_free;
+	}
+	request->file = file;
+	request->buffer = req->buffer;
+	request->user_data = req->user_data;
+	request->device_id = req->device_id;
+	memset(&request->command, 0, sizeof(request->command));
+	request->command.cmd = req->cmd;
+	request->command.buffer = request->data;
+	request->command.len = req->len;
+	request->command.timeout = req->timeout;
+	request->command.flags = (req->flags & MCUDEV_RETRY) ? MCU_COMMAND_RETRY : 0;
+	request->command.complete = mcu_dev_complete;
+	request->command.context = request;
+
+	spin_lock_irqsave(&file->lock, flags);
+	if (file->nr_requests >= MCUDEV_REQUESTS_MAX) {
+		spin_unlock_irqrestore(&file->lock, flags);
+		ret = -EBUSY;
+		goto exit_free;
+	}
+	// on the list first, the worker may complete it before mcu_bus_command_async() returns
+	list_add_tail(&request->node, &file->pending);
+	file->nr_requests++;
+	spin_unlock_irqrestore(&file->lock, flags);
+
+	mutex_lock(&dev->lock);
+	ret = dev->bus ? mcu_bus_command_async(dev->bus, req->tx_class, req->device_id, &request->command) : -ENODEV;
+	mutex_unlock(&dev->lock);
+	if (0 == ret) {
+		return 0;
+	}
+
+	spin_lock_irqsave(&file->lock, flags);
+	list_del(&request->node);
+	file->nr_requests--;
+	spin_unlock_irqrestore(&file->lock, flags);
+exit_free:
+	kfree(request);
+	return ret;
+}
+
+static struct mcu_dev_request *mcu_dev_take_done(struct mcu_dev_file *file, int *idle)
+{
+	struct mcu_dev_request *request;
+	unsigned long flags;
+
+	spin_lock_irqsave(&file->lock, flags);
+	request = list_first_entry_or_null(&file->done, struct mcu_dev_request, node);
+	if (request) {
+		list_del(&request->node);
+		file->nr_requests--;
+	}
+	*idle = list_empty(&file->pending);
+	spin_unlock_irqrestore(&file->lock, flags);
+
+	return request;
+}
+
+static void __mcu_dev_put_back(struct mcu_dev_file *file, struct mcu_dev_request *request)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&file->lock, flags);
+	list_add(&request->node, &file->done);
+	file->nr_requests++;
+	spin_unlock_irqrestore(&file->lock, flags);
+}
+
+static int mcu_dev_idle(struct mcu_dev_file *file)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&file->lock, flags);
+	ret = list_empty(&file->pending);
+	spin_unlock_irqrestore(&file->lock, flags);
+	return ret;
+}
+
+static int mcu_dev_done(struct mcu_dev_file *file)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&file->lock, flags);
+	ret = !list_empty(&file->done) || list_empty(&file->pending);
+	spin_unlock_irqrestore(&file->lock, flags);
+	return ret;
+}
+
+/* the response is copied to the buffer of the request here, in the context of the caller */
+static int mcu_dev_reap(struct mcu_dev_file *file, struct mcudev_completion __user *completions, unsigned int nr, unsigned int min_complete)
+{
+	struct mcu_dev_request *request;
+	struct mcudev_completion completion;
+	unsigned int n = 0;
+	int idle, ret;
+
+	while (n < nr) {
+		request = mcu_dev_take_done(file, &idle);
+		if (!request) {
+			// nothing left in flight to wait for
+			if (n >= min_complete || idle) {
+				break;
+			}
+			ret = wait_event_interruptible(file->wait, mcu_dev_done(file));
+			if (ret) {
+				return n ? n : ret;
+			}
+			continue;
+		}
+
+		memset(&completion, 0, sizeof(completion));
+		completion.user_data = request->user_data;
+		completion.ret = request->command.ret;
+		completion.device_id = request->device_id;
+		completion.cmd = request->command.cmd;
+		if (completion.ret > 0 && copy_to_user((void __user *)(uintptr_t)request->buffer, request->data, min_t(int, completion.ret, request->command.len))) {
+			completion.ret = -EFAULT;
+		}
+		if (copy_to_user(&completions[n], &completion, sizeof(completion))) {
+			// put back, it is reaped by the next call
+			__mcu_dev_put_back(file, request);
+			return n ? n : -EFAULT;
+		}
+		kfree(request);
+		n++;
+	}
+
+	return n;
+}
+
+static long mcu_dev_submit(struct mcu_dev_file *file, struct mcudev_submit __user *arg)
+{
+	const struct mcudev_request __user *requests;
+	struct mcudev_request req;
+	struct mcudev_submit submit;
+	int ret = 0;
+	unsigned int i;
+
+	if (copy_from_user(&submit, arg, sizeof(submit))) {
+		return -EFAULT;
+	}
+	if (submit.min_complete > submit.nr_completions || submit.reserved) {
+		return -EINVAL;
+	}
+
+	requests = (const struct mcudev_request __user *)(uintptr_t)submit.requests;
+	for (i = 0; i < submit.nr_requests; i++) {
+		if (copy_from_user(&req, &requests[i], sizeof(req))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = mcu_dev_submit_one(file, &req);
+		if (ret) {
+			break;
+		}
+	}
+	// a failure past the first request is told by submitted
+	if (ret && 0 == i) {
+		return ret;
+	}
+	submit.submitted = i;
+
+	ret = mcu_dev_reap(file, (struct mcudev_completion __user *)(uintptr_t)submit.completions, submit.nr_completions, submit.min_complete);
+	if (ret < 0 && 0 == submit.submitted) {
+		return ret;
+	}
+	submit.completed = max(ret, 0);
+
+	if (copy_to_user(arg, &submit, sizeof(submit))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long mcu_dev_claim(struct mcu_dev_file *file, unsigned long id, int claim)
+{
+	struct mcu_dev *dev = file->dev;
+	unsigned long flags;
+	long ret = 0;
+
+	if (id >= MCU_BUS_DEVICES) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&dev->claim_lock, flags);
+	if (claim) {
+		if (dev->claims[id] && dev->claims[id] != file) {
+			ret = -EBUSY;
+		}
+		else {
+			dev->claims[id] = file;
+		}
+	}
+	else if (dev->claims[id] == file) {
+		dev->claims[id] = NULL;
+	}
+	spin_unlock_irqrestore(&dev->claim_lock, flags);
+
+	return ret;
+}
+
+static long mcu_dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct mcu_dev_file *file = filp->private_data;
+
+	switch (cmd) {
+	case MCUDEV_IOC_SUBMIT:
+		return mcu_dev_submit(file, (struct mcudev_submit __user *)arg);
+	case MCUDEV_IOC_CLAIM:
+		return mcu_dev_claim(file, arg, 1);
+	case MCUDEV_IOC_RELEASE:
+		return mcu_dev_claim(file, arg, 0);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int mcu_dev_has_report(struct mcu_dev_file *file)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&file->lock, flags);
+	ret = !list_empty(&file->reports);
+	spin_unlock_irqrestore(&file->lock, flags);
+	return ret;
+}
+
+/* one report per read, the buffer has to hold all of it */
+static ssize_t mcu_dev_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct mcu_dev_file *file = filp->private_data;
+	struct mcu_dev_report *report;
+	unsigned long flags;
+	size_t len;
+	int ret;
+
+	while (1) {
+		spin_lock_irqsave(&file->lock, flags);
+		report = list_first_entry_or_null(&file->reports, struct mcu_dev_report, node);
+		if (report) {
+			len = sizeof(report->report) + report->report.len;
+			if (len > count) {
+				spin_unlock_irqrestore(&file->lock, flags);
+				return -EINVAL;
+			}
+			list_del(&report->node);
+			file->nr_reports--;
+		}
+		spin_unlock_irqrestore(&file->lock, flags);
+		if (report) {
+			break;
+		}
+
+		if (filp->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(file->wait, mcu_dev_has_report(file));
+		if (ret) {
+			return ret;
+		}
+	}
+
+	ret = copy_to_user(buf, &report->report, len) ? -EFAULT : len;
+	kfree(report);
+	return ret;
+}
+
+/* readable once a report or a completion is waiting */
+static unsigned int mcu_dev_poll(struct file *filp, poll_table *wait)
+{
+	struct mcu_dev_file *file = filp->private_data;
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	poll_wait(filp, &file->wait, wait);
+
+	spin_lock_irqsave(&file->lock, flags);
+	if (!list_empty(&file->reports) || !list_empty(&file->done)) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+	spin_unlock_irqrestore(&file->lock, flags);
+
+	return mask;
+}
+
+static int mcu_dev_open(struct inode *inode, struct file *filp)
+{
+	// set by misc_open, which holds off misc_deregister meanwhile
+	struct mcu_dev *dev = container_of(filp->private_data, struct mcu_dev, misc);
+	struct mcu_dev_file *file;
+	int ret;
+
+	ret = nonseekable_open(inode, filp);
+	if (ret) {
+		return ret;
+	}
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (!file) {
+		return -ENOMEM;
+	}
+	init_waitqueue_head(&file->wait);
+	spin_lock_init(&file->lock);
+	INIT_LIST_HEAD(&file->pending);
+	INIT_LIST_HEAD(&file->done);
+	INIT_LIST_HEAD(&file->reports);
+	kref_get(&dev->ref);
+	file->dev = dev;
+
+	filp->private_data = file;
+	return 0;
+}
+
+/* requests in flight are canceled and waited for */
+static int mcu_dev_release(struct inode *inode, struct file *filp)
+{
+	struct mcu_dev_file *file = filp->private_data;
+	struct mcu_dev *dev = file->dev;
+	struct mcu_dev_request *request, *next_request;
+	struct mcu_dev_report *report, *next_report;
+	unsigned long flags;
+	int id;
+
+	spin_lock_irqsave(&dev->claim_lock, flags);
+	for (id = 0; id < MCU_BUS_DEVICES; id++) {
+		if (dev->claims[id] == file) {
+			dev->claims[id] = NULL;
+		}
+	}
+	spin_unlock_irqrestore(&dev->claim_lock, flags);
+
+	// the bus fails what is left as it goes
+	mutex_lock(&dev->lock);
+	if (dev->bus) {
+		spin_lock_irqsave(&file->lock, flags);
+		list_for_each_entry(request, &file->pending, node) {
+			mcu_async_cancel(&request->command);
+		}
+		spin_unlock_irqrestore(&file->lock, flags);
+	}
+	mutex_unlock(&dev->lock);
+	wait_event(file->wait, mcu_dev_idle(file));
+
+	list_for_each_entry_safe(request, next_request, &file->done, node) {
+		kfree(request);
+	}
+	list_for_each_entry_safe(report, next_report, &file->reports, node) {
+		kfree(report);
+	}
+	kfree(file);
+	kref_put(&dev->ref, mcu_dev_free);
+	return 0;
+}
+
+static const struct file_operations mcu_dev_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mcu_dev_open,
+	.release	= mcu_dev_release,
+	.read		= mcu_dev_read,
+	.poll		= mcu_dev_poll,
+	.unlocked_ioctl	= mcu_dev_ioctl,
+	.compat_ioctl	= mcu_dev_ioctl,
+	.llseek		= no_llseek,
+};
+
+/* from the bus worker, for device ids without a kernel device */
+void mcu_dev_report(struct mcu_bus_device *bus, mcu_device_id device_id, mcu_control_code cmd, const unsigned char *detail, int len)
+{
+	struct mcu_dev *dev = bus->dev_data;
+	struct mcu_dev_report *report;
+	struct mcu_dev_file *file;
+	unsigned long flags;
+
+	if (!dev || !READ_ONCE(dev->claims[device_id])) {
+		return;
+	}
+
+	report = kmalloc(sizeof(*report) + len, GFP_KERNEL);
+	if (!report) {
+		return;
+	}
+	report->report.device_id = device_id;
+	report->report.cmd = cmd;
+	report->report.len = len;
+	memcpy(report->report.detail, detail, len);
+
+	spin_lock_irqsave(&dev->claim_lock, flags);
+	file = dev->claims[device_id];
+	if (file) {
+		spin_lock(&file->lock);
+		if (file->nr_reports < MCU_DEV_REPORTS_MAX) {
+			list_add_tail(&report->node, &file->reports);
+			file->nr_reports++;
+			report = NULL;
+		}
+		spin_unlock(&file->lock);
+		wake_up(&file->wait);
+	}
+	spin_unlock_irqrestore(&dev->claim_lock, flags);
+
+	kfree(report);
+}
+
+int mcu_dev_add_bus(struct mcu_bus_device *bus)
+{
+	struct mcu_dev *dev;
+	int ret;
+
+	bus->dev_data = NULL;
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev) {
+		return -ENOMEM;
+	}
+	kref_init(&dev->ref);
+	mutex_init(&dev->lock);
+	spin_lock_init(&dev->claim_lock);
+	dev->bus = bus;
+	snprintf(dev->name, sizeof(dev->name), "mcu%d", bus->nr);
+	dev->misc.minor = MISC_DYNAMIC_MINOR;
+	dev->misc.name = dev->name;
+	dev->misc.fops = &mcu_dev_fops;
+	dev->misc.parent = &bus->dev;
+	dev->misc.mode = 0600;
+
+	ret = misc_register(&dev->misc);
+	if (ret) {
+		kfree(dev);
+		return ret;
+	}
+	bus->dev_data = dev;
+	return 0;
+}
+
+/* the bus worker is stopped, requests left are failed by the bus afterwards */
+void mcu_dev_remove_bus(struct mcu_bus_device *bus)
+{
+	struct mcu_dev *dev = bus->dev_data;
+
+	if (!dev) {
+		return;
+	}
+	misc_deregister(&dev->misc);
+	mutex_lock(&dev->lock);
+	dev->bus = NULL;
+	mutex_unlock(&dev->lock);
+	bus->dev_data = NULL;
+	kref_put(&dev->ref, mcu_dev_free);
+}
@@ -7,141 +7,103 @@
  */
 
 #include <linux/module.h>
-#include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/rcupdate.h>
 #include "mcu-event.h"
 #include "mcu-bus.h"
+#include "mcu-trace.h"
 
 
-static DEFINE_SPINLOCK(mcu_event_lock);	/* protects mcu_event_list */
-static LIST_HEAD(mcu_event_list);
-
-static struct mcu_event *mcu_event_find_response(struct mcu_bus_device *bus, const struct mcu_packet *req, enum mcu_event_type type, struct mcu_event **eventp)
+/* wake the worker of the bus, it is cleared and synchronized before the worker stops */
+static void mcu_event_wake(struct mcu_bus_device *bus)
 {
-	struct mcu_event *event, *next;
-	list_for_each_entry_safe(event, next, &bus->event_list, node) {
-		if (event->type == type && event->bus == bus && mcu_packet_response_to(req, event->object)) {
-			*eventp = event;
-			return event;
-		}
-	}
+	struct task_struct *task;
 
-	return NULL;
+	rcu_read_lock();
+	task = rcu_dereference(bus->event_task);
+	if (likely(task)) {
+		wake_up_process(task);
+	}
+	rcu_read_unlock();
 }
 
-struct mcu_event *mcu_wait_event(struct mcu_bus_device *bus, const struct mcu_packet *packet, enum mcu_event_type type, int timeout)
+/* device, code, detail length and tag of the packet an event carries */
+static void __mcu_event_trace(struct mcu_event *event, int dequeue)
 {
-	struct mcu_event *event = NULL;
-	unsigned long flags;
-	int ret;
+	mcu_device_id device_id = 0;
+	mcu_control_code control_code = 0;
+	int len = 0, tag = -1;
 
-	{
-		ret = wait_event_interruptible_timeout(bus->wait_queue, mcu_event_find_response(bus, packet, type, &event), msecs_to_jiffies(timeout));
-		if (ret <= 0) {
-			// timeout
-			return NULL;
-		}
-		spin_lock_irqsave(&bus->event_lock, flags);
-		if (event) {
-			list_del(&event->node);
-			goto found;
-		}
-		spin_unlock_irqrestore(&bus->event_lock, flags);
+	if (MCU_CONTROL_REQUEST_DETECTED == event->type) {
+		mcu_packet_extract_control_info(event->object, &device_id, &control_code, &len);
+		tag = mcu_packet_tag(event->object);
+	}
+	if (dequeue) {
+		trace_mcu_event_dequeue(event->bus->nr, event->type, device_id, control_code, len, tag);
+	}
+	else {
+		trace_mcu_event_queue(event->bus->nr, event->type, device_id, control_code, len, tag);
 	}
-
-	return NULL;
-
-found:
-	spin_unlock_irqrestore(&bus->event_lock, flags);
-	return event;
 }
 
-void mcu_notify_event(struct mcu_event *event)
+struct llist_node *mcu_get_events(struct mcu_bus_device *bus)
 {
-	unsigned long flags;
-	struct mcu_bus_device *bus = event->bus;
-	if (unlikely(!bus)) {
-		return;
-	}
-
-	spin_lock_irqsave(&bus->event_lock, flags);
-	if (waitqueue_active(&bus->wait_queue)) {
-		list_add_tail(&event->node, &bus->event_list);
-		wake_up(&bus->wait_queue);
+	struct llist_node *events;
+	struct mcu_event *event;
+
+	// llist is last in first out
+	events = llist_reverse_order(llist_del_all(&bus->event_queue));
+	if (trace_mcu_event_dequeue_enabled()) {
+		llist_for_each_entry(event, events, llnode) {
+			__mcu_event_trace(event, 1);
+		}
 	}
-
-	spin_unlock_irqrestore(&bus->event_lock, flags);
+	return events;
 }
 
-
-struct mcu_event *mcu_get_event(void)
+int mcu_test_event(struct mcu_bus_device *bus, enum mcu_event_type event_type)
 {
-	struct mcu_event *event = NULL;
-	unsigned long flags;
-
-	spin_lock_irqsave(&mcu_event_lock, flags);
-
-	if (!list_empty(&mcu_event_list)) {
-		event = list_first_entry(&mcu_event_list, struct mcu_event, node);
-		list_del_init(&event->node);
+	if (!test_and_clear_bit(event_type, &bus->event_flags)) {
+		return 0;
 	}
-
-	spin_unlock_irqrestore(&mcu_event_lock, flags);
-	return event;
+	trace_mcu_event_dequeue(bus->nr, event_type, 0, 0, 0, -1);
+	return 1;
 }
 
-void mcu_free_event(struct mcu_event *event)
+int mcu_event_pending(struct mcu_bus_device *bus)
 {
-	kfree(event);
+	return READ_ONCE(bus->event_flags) || !llist_empty(&bus->event_queue);
 }
 
-void mcu_remove_duplicate_events(void *object, enum mcu_event_type type)
+void mcu_free_event(struct mcu_event *event)
 {
-	struct mcu_event *e, *next;
-	unsigned long flags;
-
-	spin_lock_irqsave(&mcu_event_lock, flags);
-
-	list_for_each_entry_safe(e, next, &mcu_event_list, node) {
-		if (object == e->object) {
-			/*
-			 * If this event is of different type we should not
-			 * look further - we only suppress duplicate events
-			 * that were sent back-to-back.
-			 */
-			if (type != e->type)
-				break;
-
-			list_del_init(&e->node);
-			mcu_free_event(e);
-		}
+	switch (event->type) {
+	case MCU_CONTROL_REQUEST_DETECTED:
+		// the event goes with the packet
+		mcu_packet_put(event->object);
+		break;
+	default:
+		break;
 	}
-
-	spin_unlock_irqrestore(&mcu_event_lock, flags);
 }
 
-struct mcu_event *mcu_queue_event(void *object, struct mcu_bus_device *bus, enum mcu_event_type event_type)
+/* events are handled in order by the worker of their bus */
+void mcu_queue_event(struct mcu_event *event)
 {
-	unsigned long flags;
-	struct mcu_event *event = NULL;
-
-	spin_lock_irqsave(&mcu_event_lock, flags);
+	struct mcu_bus_device *bus = event->bus;
 
-	event = kmalloc(sizeof(struct mcu_event), GFP_ATOMIC);
-	if (!event) {
-		pr_err("Not enough memory to queue event %d\n", event_type);
-		goto out;
+	// the worker may free the event once it is queued
+	if (trace_mcu_event_queue_enabled()) {
+		__mcu_event_trace(event, 0);
 	}
-
-	event->type = event_type;
-	event->object = object;
-	event->bus = bus;
-
-	list_add_tail(&event->node, &mcu_event_list);
-	queue_work(system_long_wq, &mcu_event_work);
-
-out:
-	spin_unlock_irqrestore(&mcu_event_lock, flags);
-	return event;
+	llist_add(&event->llnode, &bus->event_queue);
+	mcu_event_wake(bus);
 }
 
+/* repeated signals before the worker runs are handled once */
+void mcu_signal_event(struct mcu_bus_device *bus, enum mcu_event_type event_type)
+{
+	trace_mcu_event_queue(bus->nr, event_type, 0, 0, 0, -1);
+	set_bit(event_type, &bus->event_flags);
+	mcu_event_wake(bus);
+}
@@ -11,36 +11,40 @@
 #define __MCU_EVENT_H_
 
 #include <linux/module.h>
+#include <linux/llist.h>
 #include "mcu-packet.h"
 
 
 enum mcu_event_type {
 	MCU_DATA_RECEIVED,
-	MCU_WRITE_COMPLETE,
-	MCU_PING_DETECTED,
-	MCU_PONG_DETECTED,
 	MCU_CONTROL_REQUEST_DETECTED,
-	MCU_CONTROL_RESPONSE_DETECTED,
 	MCU_LATE_INIT,
+	MCU_ASYNC_COMMAND,
 };
 
 struct mcu_bus_device;
 
+/*
+ * events of a packet are embedded in the packet and own a reference of it,
+ * MCU_DATA_RECEIVED, MCU_LATE_INIT and MCU_ASYNC_COMMAND carry nothing and are only flagged
+ */
 struct mcu_event {
 	enum mcu_event_type type;
 	void *object;
 	struct mcu_bus_device *bus;
-	struct list_head node;
+	// queued for the bus worker
+	struct llist_node llnode;
 };
 
-extern struct work_struct mcu_event_work;
-
-struct mcu_event *mcu_get_event(void);
+/* events queued so far in queued order, for the bus worker */
+struct llist_node *mcu_get_events(struct mcu_bus_device *bus);
+/* test and clear a flagged event */
+int mcu_test_event(struct mcu_bus_device *bus, enum mcu_event_type event_type);
+int mcu_event_pending(struct mcu_bus_device *bus);
 void mcu_free_event(struct mcu_event *event);
-void mcu_remove_duplicate_events(void *object, enum mcu_event_type type);
-struct mcu_event *mcu_queue_event(void *object, struct mcu_bus_device *bus, enum mcu_event_type event_type);
-struct mcu_event *mcu_wait_event(struct mcu_bus_device *bus, const struct mcu_packet *packet, enum mcu_event_type type, int timeout);
-void mcu_notify_event(struct mcu_event *event);
+/* never allocate, may be called in any context */
+void mcu_queue_event(struct mcu_event *event);
+void mcu_signal_event(struct mcu_bus_device *bus, enum mcu_event_type event_type);
 
 #endif	// __MCU_EVENT_H_
 
@@ -48,6 +48,44 @@ static void mcu_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
 	mcu_gpio_command(chip, value ? 'l' : 'h', offset, NULL);
 }
 
+/* commands packed per batch call, bounded to keep the stack small */
+#define MCU_GPIO_BATCH_MAX	16
+
+static void mcu_gpio_command_batch(struct mcu_gpio_private *data, struct mcu_command *cmds, int count)
+{
+	int i;
+
+	mcu_device_command_batch(data->device, cmds, count);
+	for (i = 0; i < count; i++) {
+		if (cmds[i].ret < 0) {
+			dev_warn(&data->device->dev, "failed to send commad: cmd=%c, gpio=%d\n", cmds[i].cmd, cmds[i].buffer[0]);
+		}
+	}
+}
+
+static void mcu_gpio_set_multiple(struct gpio_chip *chip, unsigned long *mask, unsigned long *bits)
+{
+	struct mcu_gpio_private *data = to_mcu_gpio(chip);
+	struct mcu_command cmds[MCU_GPIO_BATCH_MAX];
+	unsigned char offsets[MCU_GPIO_BATCH_MAX];
+	unsigned offset;
+	int n = 0;
+
+	for_each_set_bit(offset, mask, chip->ngpio) {
+		offsets[n] = offset;
+		cmds[n].cmd = test_bit(offset, bits) ? 'l' : 'h';
+		cmds[n].buffer = &offsets[n];
+		cmds[n].len = sizeof(offsets[n]);
+		if (++n == MCU_GPIO_BATCH_MAX) {
+			mcu_gpio_command_batch(data, cmds, n);
+			n = 0;
+		}
+	}
+	if (n) {
+		mcu_gpio_command_batch(data, cmds, n);
+	}
+}
+
 static int mcu_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
 {
 	int ret, value;
@@ -107,6 +145,7 @@ static int mcu_gpio_probe(struct mcu_device *device, const struct mcu_device_id
 	data->chip.direction_output = mcu_gpio_direction_output;
 	data->chip.get = mcu_gpio_get;
 	data->chip.set = mcu_gpio_set;
+	data->chip.set_multiple = mcu_gpio_set_multiple;
 
 	return gpiochip_add(&data->chip);
 }
@@ -145,5 +184,8 @@ struct mcu_driver __mcu_gpio = {
 	.probe	= mcu_gpio_probe,
 	.remove	= mcu_gpio_remove,
 	.id_table	= mcu_gpio_id,
+	.tx_class	= MCU_TX_URGENT,
+	// reading or setting a level or direction twice does no harm
+	.retry_codes	= "rehlio",
 };
 
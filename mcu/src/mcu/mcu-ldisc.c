@@ -27,28 +27,27 @@ static ssize_t sermcu_ldisc_write(struct tty_struct *tty, struct file *file, con
 	return -EFAULT;
 }
 
+/* bytes flagged with an error are dropped, the runs between them are passed on whole */
 static void sermcu_ldisc_receive(struct tty_struct *tty, const unsigned char *cp, char *fp, int count)
 {
 	struct sermcu *sermcu = (struct sermcu *)tty->disc_data;
 	unsigned long flags;
-	int i;
-	int has_error = 0;
+	int i, start = 0;
 
 	spin_lock_irqsave(&sermcu->lock, flags);
 
-	for (i = 0; i < count; i++) {
-		if (fp && *fp++) {
+	for (i = 0; fp && i < count; i++) {
+		if (fp[i]) {
 			// got an error
-			has_error = 1;
-			continue;
-		}
-		if (has_error) {
-			mcu_receive(sermcu->mcu, &cp[i], 1);
+			if (i > start) {
+				mcu_receive(sermcu->mcu, &cp[start], i - start);
+			}
+			start = i + 1;
 		}
 	}
 
-	if (!has_error) {
-		mcu_receive(sermcu->mcu, cp, count);
+	if (count > start) {
+		mcu_receive(sermcu->mcu, &cp[start], count - start);
 	}
 
 	spin_unlock_irqrestore(&sermcu->lock, flags);
@@ -0,0 +1,325 @@
+/*
+ * mcu-link.c
+ * mcu coprocessor bus protocol, link management
+ *
+ * Author: Alex.wang
+ * Create: 2015-08-02 16:20
+ */
+
+#include <linux/module.h>
+#include <linux/semaphore.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
+#include <asm/unaligned.h>
+#include "mcu-internal.h"
+#include "mcu-packet.h"
+#include "mcu-event.h"
+
+/* old firmware does not know the link device and may not answer at all */
+#define MCU_LINK_TIMEOUT	500
+
+/* features the host side implements, baud rate switch depends on the backend */
+#define MCU_LINK_FEATURES_SUPPORTED	(MCU_LINK_FEATURE_TAGGED | MCU_LINK_FEATURE_BATCH | MCU_LINK_FEATURE_SEGMENT)
+
+/*
+ * after a baud rate switch, the mcu goes back to the previous rate
+ * if no valid frame arrived within MCU_LINK_BAUD_REVERT ms
+ */
+#define MCU_LINK_BAUD_SETTLE	20
+#define MCU_LINK_BAUD_REVERT	1000
+#define MCU_LINK_BAUD_PINGS	4
+
+/* the mcu is pinged this often, a suspect link right away */
+static unsigned int heartbeat_ms = 1000;
+module_param(heartbeat_ms, uint, 0644);
+MODULE_PARM_DESC(heartbeat_ms, "ms between pings checking the mcu is alive, 0 to disable");
+
+#define MCU_LINK_HEARTBEAT_TIMEOUT	500
+/* heartbeats missed in a row before the link is down */
+#define MCU_LINK_DOWN_MISSES	3
+
+/* agree on features and window with the mcu, keep legacy mode on any error */
+static int mcu_link_features(struct mcu_bus_device *bus)
+{
+	unsigned char buffer[4];
+	int features, window, ret;
+
+	buffer[0] = MCU_LINK_FEATURES_SUPPORTED;
+	if (bus->set_baud && bus->nr_baud_rates) {
+		buffer[0] |= MCU_LINK_FEATURE_BAUD;
+	}
+	buffer[1] = mcu_packet_tx_window_max(bus);
+	put_unaligned_le16(mcu_packet_transfer_size_max(bus), &buffer[2]);
+	ret = mcu_bus_command(bus, MCU_TX_URGENT, MCU_LINK_DEVICE_ID, MCU_LINK_FEATURES, buffer, sizeof(buffer), MCU_LINK_TIMEOUT);
+	if (ret < 2) {
+		dev_info(&bus->dev, "link negotiation failed, legacy mode: ret=%d\n", ret);
+		return ret < 0 ? ret : -EPROTO;
+	}
+
+	features = buffer[0] & (MCU_LINK_FEATURES_SUPPORTED | MCU_LINK_FEATURE_BAUD);
+	window = 1;
+	if (features & MCU_LINK_FEATURE_TAGGED) {
+		window = clamp_t(int, buffer[1], 1, mcu_packet_tx_window_max(bus));
+	}
+	// transfer size is optional in the response
+	bus->link_transfer_size = ret >= 4 ? get_unaligned_le16(&buffer[2]) : 0;
+	if (bus->link_transfer_size <= MCU_PACKET_MAX_LENGTH) {
+		features &= ~MCU_LINK_FEATURE_SEGMENT;
+	}
+
+	bus->link_features = features;
+	bus->stats.tx_window = window;
+	// the window starts with one request in flight
+	while (--window > 0) {
+		up(&bus->tx_window);
+	}
+	mcu_signal_event(bus, MCU_ASYNC_COMMAND);
+
+	dev_info(&bus->dev, "link features 0x%02x, %u requests in flight, transfer %u bytes\n", features, bus->stats.tx_window, bus->link_transfer_size);
+	return 0;
+}
+
+static int mcu_link_ping_burst(struct mcu_bus_device *bus)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < MCU_LINK_BAUD_PINGS && 0 == ret; i++) {
+		ret = mcu_bus_ping(bus, MCU_LINK_TIMEOUT);
+	}
+	return ret;
+}
+
+/* both sides switch once the mcu acknowledged the rate, verified by pings */
+static int mcu_link_switch_baud(struct mcu_bus_device *bus, unsigned int baud)
+{
+	unsigned char buffer[4];
+	int ret;
+
+	put_unaligned_le32(baud, buffer);
+	ret = mcu_bus_command(bus, MCU_TX_URGENT, MCU_LINK_DEVICE_ID, MCU_LINK_BAUD, buffer, sizeof(buffer), MCU_LINK_TIMEOUT);
+	if (ret < (int)sizeof(buffer) || get_unaligned_le32(buffer) != baud) {
+		return ret < 0 ? ret : -EPROTO;
+	}
+
+	ret = bus->set_baud(bus, baud);
+	if (0 == ret) {
+		msleep(MCU_LINK_BAUD_SETTLE);
+		ret = mcu_link_ping_burst(bus);
+		if (0 == ret) {
+			return 0;
+		}
+	}
+
+	// wait for the mcu to give up the new rate as well
+	bus->set_baud(bus, bus->fallback_baud);
+	msleep(MCU_LINK_BAUD_REVERT);
+	if (mcu_link_ping_burst(bus)) {
+		dev_err(&bus->dev, "link lost after failed switch to %u baud\n", baud);
+	}
+	return ret;
+}
+
+/* try the configured rates in order, stay at the fallback rate if none works */
+static void mcu_link_baud(struct mcu_bus_device *bus)
+{
+	int i, ret;
+
+	for (i = 0; i < bus->nr_baud_rates; i++) {
+		if (bus->baud_rates[i] == bus->fallback_baud) {
+			break;
+		}
+		ret = mcu_link_switch_baud(bus, bus->baud_rates[i]);
+		if (0 == ret) {
+			bus->stats.baud = bus->baud_rates[i];
+			dev_info(&bus->dev, "link switched to %u baud\n", bus->stats.baud);
+			return;
+		}
+		dev_warn(&bus->dev, "link failed to switch to %u baud: ret=%d\n", bus->baud_rates[i], ret);
+	}
+}
+
+/*
+ * the window is back to one request in flight before features are agreed again,
+ * commands fail while the link is down so the slots come back soon
+ */
+static void mcu_link_window_reset(struct mcu_bus_device *bus)
+{
+	while (bus->stats.tx_window > 1) {
+		down(&bus->tx_window);
+		bus->stats.tx_window--;
+	}
+}
+
+static void mcu_link_set_state(struct mcu_bus_device *, enum mcu_link_state);
+
+static void mcu_link_negotiate(struct work_struct *work)
+{
+	struct mcu_bus_device *bus = container_of(work, struct mcu_bus_device, link_work);
+
+	// the mcu answers again, it is up once untagged requests can not be in flight side by side
+	if (READ_ONCE(bus->link_recovering)) {
+		mcu_link_window_reset(bus);
+		mcu_link_set_state(bus, MCU_LINK_UP);
+	}
+
+	bus->stats.baud = bus->fallback_baud;
+	if (0 == mcu_link_features(bus) && (bus->link_features & MCU_LINK_FEATURE_BAUD)) {
+		mcu_link_baud(bus);
+	}
+
+	// drivers hear the mcu is back once it talks at the negotiated rate again
+	if (xchg(&bus->link_recovering, 0) && !mcu_link_down(bus)) {
+		mcu_bus_link_change(bus, MCU_LINK_UP);
+	}
+}
+
+/* a reset mcu is back at the fallback rate in legacy mode, the heartbeat pings it there */
+static void mcu_link_fallback(struct mcu_bus_device *bus)
+{
+	int ret;
+
+	bus->link_features = 0;
+	if (!bus->set_baud || bus->stats.baud == bus->fallback_baud) {
+		return;
+	}
+	ret = bus->set_baud(bus, bus->fallback_baud);
+	if (ret) {
+		dev_warn(&bus->dev, "failed to fall back to %u baud: ret=%d\n", bus->fallback_baud, ret);
+		return;
+	}
+	bus->stats.baud = bus->fallback_baud;
+}
+
+const char *mcu_link_state_name(enum mcu_link_state state)
+{
+	switch (state) {
+	case MCU_LINK_UP:
+		return "up";
+	case MCU_LINK_DEGRADED:
+		return "degraded";
+	default:
+		return "down";
+	}
+}
+
+/*
+ * heartbeat and negotiation only, down is left through negotiation,
+ * drivers hear of down, and of back up once negotiation is done again
+ */
+static void mcu_link_set_state(struct mcu_bus_device *bus, enum mcu_link_state state)
+{
+	enum mcu_link_state old = bus->link_state;
+
+	if (state == old) {
+		return;
+	}
+	WRITE_ONCE(bus->link_state, state);
+	dev_info(&bus->dev, "link %s\n", mcu_link_state_name(state));
+
+	if (MCU_LINK_DOWN == state) {
+		bus->stats.link_downs++;
+		// commands waiting fail now
+		mcu_signal_event(bus, MCU_ASYNC_COMMAND);
+		mcu_link_fallback(bus);
+		mcu_bus_link_change(bus, state);
+	}
+}
+
+/* commands keep failing until negotiation shrank the window */
+static void mcu_link_recover(struct mcu_bus_device *bus)
+{
+	if (!READ_ONCE(bus->link_stopping)) {
+		WRITE_ONCE(bus->link_recovering, 1);
+		schedule_work(&bus->link_work);
+	}
+}
+
+static void mcu_link_heartbeat(struct work_struct *work)
+{
+	struct mcu_bus_device *bus = container_of(to_delayed_work(work), struct mcu_bus_device, link_heartbeat);
+	unsigned int interval = READ_ONCE(heartbeat_ms);
+	unsigned long delay;
+	int ret = 0;
+
+	// negotiation pings on its own, and a baud rate switch looks like a dead link
+	if (!work_busy(&bus->link_work)) {
+		ret = mcu_bus_ping(bus, MCU_LINK_HEARTBEAT_TIMEOUT);
+		if (0 == ret) {
+			bus->link_misses = 0;
+			if (mcu_link_down(bus)) {
+				mcu_link_recover(bus);
+			}
+			else {
+				mcu_link_set_state(bus, MCU_LINK_UP);
+			}
+		}
+		else if (-ETIME == ret) {
+			bus->link_misses++;
+			mcu_link_set_state(bus, bus->link_misses >= MCU_LINK_DOWN_MISSES ? MCU_LINK_DOWN : MCU_LINK_DEGRADED);
+		}
+		// other errors tell nothing about the mcu
+	}
+
+	if (0 == interval || READ_ONCE(bus->link_stopping)) {
+		return;
+	}
+	delay = msecs_to_jiffies(interval);
+	if (-ETIME == ret && MCU_LINK_DEGRADED == bus->link_state) {
+		delay = 0;
+	}
+	schedule_delayed_work(&bus->link_heartbeat, delay);
+}
+
+void mcu_link_suspect(struct mcu_bus_device *bus)
+{
+	if (READ_ONCE(heartbeat_ms) && !READ_ONCE(bus->link_stopping)) {
+		mod_delayed_work(system_wq, &bus->link_heartbeat, 0);
+	}
+}
+
+int mcu_link_down(struct mcu_bus_device *bus)
+{
+	return MCU_LINK_DOWN == READ_ONCE(bus->link_state);
+}
+
+void mcu_link_init(struct mcu_bus_device *bus)
+{
+	bus->link_features = 0;
+	bus->link_transfer_size = 0;
+	bus->link_state = MCU_LINK_UP;
+	bus->link_misses = 0;
+	bus->link_stopping = 0;
+	bus->link_recovering = 0;
+	bus->stats.tx_window = 1;
+	sema_init(&bus->tx_window, 1);
+	INIT_WORK(&bus->link_work, mcu_link_negotiate);
+	INIT_DELAYED_WORK(&bus->link_heartbeat, mcu_link_heartbeat);
+}
+
+/*
+ * the bus worker delivers the response,
+ * so negotiation has to wait in a work of its own
+ */
+void mcu_link_start(struct mcu_bus_device *bus)
+{
+	unsigned int interval = READ_ONCE(heartbeat_ms);
+
+	schedule_work(&bus->link_work);
+	if (interval) {
+		schedule_delayed_work(&bus->link_heartbeat, msecs_to_jiffies(interval));
+	}
+}
+
+void mcu_link_stop(struct mcu_bus_device *bus)
+{
+	WRITE_ONCE(bus->link_stopping, 1);
+	// the heartbeat queues negotiation again on recovery
+	cancel_delayed_work_sync(&bus->link_heartbeat);
+	cancel_work_sync(&bus->link_work);
+}
+
+/* the bus worker may have suspected the link until it stopped */
+void mcu_link_deinit(struct mcu_bus_device *bus)
+{
+	cancel_delayed_work_sync(&bus->link_heartbeat);
+}
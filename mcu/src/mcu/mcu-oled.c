@@ -13,6 +13,7 @@
 #include <linux/fs.h>
 #include <linux/of.h>
 #include <linux/miscdevice.h>
+#include <linux/workqueue.h>
 #include <linux/mcu.h>
 #include <linux/lq12864.h>
 #include "mcu-internal.h"
@@ -224,10 +225,42 @@ struct mcu_protocol_draw {
 	u8 data[LQ12864_WIDTH];
 };
 
+/* whole screen in one draw, sent as a segmented transfer */
+struct mcu_protocol_draw_frame {
+	u8 x;
+	u8 width;
+	u8 width2;
+	u8 y:3;
+	u8 inverse:1;
+	u8 height:4;
+	u8 data[LQ12864_HEIGHT][LQ12864_WIDTH];
+};
+
+/*
+ * compressed page, Y&M followed by run length tokens:
+ * 0x80 | (n - 1) then one byte repeated n times, or
+ * n - 1 then n literal bytes
+ */
+#define LQ12864_ZDRAW_DELTA	0x10	// xor against the page content shown
+#define LQ12864_RLE_RUN	0x80
+#define LQ12864_RLE_MAX	128
+
 struct lq12864_data {
 	struct mcu_protocol_draw line[LQ12864_HEIGHT];
+	struct mcu_protocol_draw_frame frame;
+	// page content the mcu shows, valid bit per line
+	u8 shadow[LQ12864_HEIGHT][LQ12864_WIDTH];
+	u8 shadow_valid;
+	// compressed pages, cleared if the mcu does not know 'Z'
+	u8 zline[LQ12864_HEIGHT][1 + LQ12864_WIDTH];
+	u8 zdelta[LQ12864_WIDTH];
+	int compress;
 	struct mcu_device *device;
 	struct mutex lock;
+	// the screen is sent again once the link is back, not queued any more once removing
+	struct work_struct restore;
+	spinlock_t restore_lock;
+	int removing;
 } *lq12864 = NULL;
 
 
@@ -235,11 +268,21 @@ static s32 lq12864_ioctl_fill(struct mcu_device *device, u8 what)
 {
 	unsigned char buffer[] = {what};
 	u32 y;
+	s32 ret;
 	for (y = 0; y < LQ12864_HEIGHT; y++) {
 		lq12864->line[y].inverse = 0;
 		memset(lq12864->line[y].data, what, sizeof(lq12864->line[y].data));
 	}
-	return mcu_device_command(device, 'F', buffer, sizeof(buffer)) < 0;
+	ret = mcu_device_command(device, 'F', buffer, sizeof(buffer)) < 0;
+	if (0 == ret) {
+		memset(lq12864->shadow, what, sizeof(lq12864->shadow));
+		lq12864->shadow_valid = 0xff;
+	}
+	else {
+		// the mcu may have filled anyway, no delta against the old pages
+		lq12864->shadow_valid = 0;
+	}
+	return ret;
 }
 
 static s32 lq12864_ioctl_clear(struct mcu_device *device)
@@ -247,22 +290,169 @@ static s32 lq12864_ioctl_clear(struct mcu_device *device)
 	return lq12864_ioctl_fill(device, 0);
 }
 
-static s32 lq12864_ioctl_sync(struct mcu_device *device)
+/* return -EMSGSIZE if the bus can not carry a whole frame */
+static s32 lq12864_sync_frame(struct mcu_device *device)
 {
+	struct mcu_protocol_draw_frame *frame = &lq12864->frame;
 	u32 y;
-	u32 ret = 0;
+	s32 ret;
+
+	frame->x = 0;
+	frame->width = LQ12864_WIDTH;
+	frame->width2 = LQ12864_WIDTH;
+	frame->y = 0;
+	frame->inverse = 0;
+	frame->height = LQ12864_HEIGHT;
+	for (y = 0; y < LQ12864_HEIGHT; y++) {
+		memcpy(frame->data[y], lq12864->line[y].data, LQ12864_WIDTH);
+	}
 
-	for (y = 0; y < LQ12864_HEIGHT; y++)
-	{
-		if (lq12864->line[y].inverse) {
+	ret = mcu_device_command(device, 'D', (unsigned char *)frame, sizeof(*frame));
+	if (ret >= 0) {
+		for (y = 0; y < LQ12864_HEIGHT; y++) {
 			lq12864->line[y].inverse = 0;
-			ret = mcu_device_command(device, 'D', (unsigned char *)&lq12864->line[y], sizeof(struct mcu_protocol_draw));
-			if (ret < 0) {
-				pr_err("%s: failed to sync line %d, ret=%d", __func__, y, ret);
-			}
 		}
+		memcpy(lq12864->shadow, frame->data, sizeof(lq12864->shadow));
+		lq12864->shadow_valid = 0xff;
+	}
+	else if (-EMSGSIZE != ret) {
+		// a timed out draw may still have been applied
+		lq12864->shadow_valid = 0;
+	}
+
+	return ret;
+}
+
+/* return encoded size, or -1 if it does not fit in size */
+static s32 lq12864_rle_encode(u8 *dst, s32 size, const u8 *src, const u8 *ref)
+{
+	s32 i = 0, n = 0, lit = -1, run;
+	u8 c;
+
+#define LQ12864_RLE_BYTE(i)	(ref ? src[i] ^ ref[i] : src[i])
+	while (i < LQ12864_WIDTH) {
+		c = LQ12864_RLE_BYTE(i);
+		for (run = 1; i + run < LQ12864_WIDTH && run < LQ12864_RLE_MAX; run++) {
+			if (LQ12864_RLE_BYTE(i + run) != c)
+				break;
+		}
+
+		if (run >= 3) {
+			if (n + 2 > size)
+				return -1;
+			dst[n++] = LQ12864_RLE_RUN | (run - 1);
+			dst[n++] = c;
+			lit = -1;
+			i += run;
+			continue;
+		}
+
+		// extend the pending literal, or start a new one
+		if (lit < 0 || dst[lit] == LQ12864_RLE_MAX - 1) {
+			if (n + 2 > size)
+				return -1;
+			lit = n;
+			dst[n++] = 0;
+		}
+		else {
+			if (n + 1 > size)
+				return -1;
+			dst[lit]++;
+		}
+		dst[n++] = c;
+		i++;
+	}
+#undef LQ12864_RLE_BYTE
+
+	return n;
+}
+
+/* pick the smallest of raw, rle and delta rle for a dirty line */
+static void lq12864_encode_line(u32 y, struct mcu_command *cmd)
+{
+	u8 *zline = lq12864->zline[y];
+	s32 len, delta;
+
+	lq12864->line[y].inverse = 0;
+	cmd->cmd = 'D';
+	cmd->buffer = (unsigned char *)&lq12864->line[y];
+	cmd->len = sizeof(struct mcu_protocol_draw);
+
+	if (!lq12864->compress) {
+		return;
+	}
+
+	// anything up to a page is smaller than a raw draw
+	zline[0] = y;
+	len = lq12864_rle_encode(&zline[1], LQ12864_WIDTH, lq12864->line[y].data, NULL);
+	if (lq12864->shadow_valid & BIT(y)) {
+		delta = lq12864_rle_encode(lq12864->zdelta, len > 0 ? len - 1 : LQ12864_WIDTH, lq12864->line[y].data, lq12864->shadow[y]);
+		if (delta > 0) {
+			memcpy(&zline[1], lq12864->zdelta, delta);
+			zline[0] = y | LQ12864_ZDRAW_DELTA;
+			len = delta;
+		}
+	}
+	if (len > 0) {
+		cmd->cmd = 'Z';
+		cmd->buffer = zline;
+		cmd->len = 1 + len;
+	}
+}
+
+static s32 lq12864_ioctl_sync(struct mcu_device *device)
+{
+	struct mcu_command cmds[LQ12864_HEIGHT];
+	u32 lines[LQ12864_HEIGHT];
+	u32 y, i, n = 0, retry = 0;
+	s32 ret = 0;
+
+	for (y = 0; y < LQ12864_HEIGHT; y++) {
+		if (lq12864->line[y].inverse) {
+			lines[n++] = y;
+		}
+	}
+	// without compression, one transfer beats a round trip per line once half the screen changed
+	if (!lq12864->compress && n * 2 >= LQ12864_HEIGHT) {
+		ret = lq12864_sync_frame(device);
+		if (-EMSGSIZE != ret) {
+			return ret;
+		}
+	}
+	if (0 == n) {
+		return 0;
 	}
 
+	for (i = 0; i < n; i++) {
+		lq12864_encode_line(lines[i], &cmds[i]);
+	}
+	ret = mcu_device_command_batch(device, cmds, n);
+
+	for (i = 0; i < n; i++) {
+		y = lines[i];
+		if (cmds[i].ret >= 0) {
+			memcpy(lq12864->shadow[y], lq12864->line[y].data, LQ12864_WIDTH);
+			lq12864->shadow_valid |= BIT(y);
+			continue;
+		}
+
+		// keep it dirty for the next sync, sent whole as the mcu may have drawn it anyway
+		lq12864->line[y].inverse = 1;
+		lq12864->shadow_valid &= ~BIT(y);
+		if ('Z' == cmds[i].cmd && -MCU_ERROR_INVALID_CODE == cmds[i].ret) {
+			lq12864->compress = 0;
+			retry = 1;
+		}
+		else {
+			pr_err("%s: failed to sync line %d, ret=%d", __func__, y, cmds[i].ret);
+			ret = cmds[i].ret;
+		}
+	}
+
+	// mcu does not know compressed pages, send them raw
+	if (retry) {
+		return lq12864_ioctl_sync(device);
+	}
 	return ret;
 }
 
@@ -495,6 +685,22 @@ static struct miscdevice lq12864_device = {
 	.fops = &lq12864_fops,
 };
 
+static void mcu_oled_restore(struct work_struct *work)
+{
+	struct lq12864_data *data = container_of(work, struct lq12864_data, restore);
+	int y;
+
+	mutex_lock(&data->lock);
+	for (y = 0; y < LQ12864_HEIGHT; y++) {
+		data->line[y].inverse = 1;
+	}
+	data->shadow_valid = 0;
+	if (lq12864_ioctl_sync(data->device)) {
+		dev_warn(&data->device->dev, "failed to restore screen\n");
+	}
+	mutex_unlock(&data->lock);
+}
+
 static int mcu_oled_probe(struct mcu_device *device, const struct mcu_device_id *id)
 {
 	struct device *dev = &device->dev;
@@ -513,8 +719,11 @@ static int mcu_oled_probe(struct mcu_device *device, const struct mcu_device_id
 
 		{
 			mutex_init(&state->lock);
+			INIT_WORK(&state->restore, mcu_oled_restore);
+			spin_lock_init(&state->restore_lock);
 			mcu_set_drvdata(device, state);
 			state->device = device;
+			state->compress = 1;
 
 			ret = misc_register(&lq12864_device);
 			if (ret) {
@@ -554,11 +763,31 @@ static int mcu_oled_remove(struct mcu_device *device)
 	struct lq12864_data *state = mcu_get_drvdata(device);
 
 	misc_deregister(&lq12864_device);
+	spin_lock(&state->restore_lock);
+	state->removing = 1;
+	spin_unlock(&state->restore_lock);
+	cancel_work_sync(&state->restore);
 	mutex_destroy(&state->lock);
 	kfree(state);
 	return 0;
 }
 
+/* the mcu may have been reset with a blank screen, send all of it again */
+static void mcu_oled_link_change(struct mcu_device *device, enum mcu_link_state state)
+{
+	struct lq12864_data *data = mcu_get_drvdata(device);
+
+	if (MCU_LINK_UP != state) {
+		return;
+	}
+	// a whole screen may take several commands, not in the callback
+	spin_lock(&data->restore_lock);
+	if (!data->removing) {
+		schedule_work(&data->restore);
+	}
+	spin_unlock(&data->restore_lock);
+}
+
 #if IS_ENABLED(CONFIG_OF)
 static const struct of_device_id mcu_oled_dt_match[] = {
 	{ .compatible = "lbs,mcu-oled" },
@@ -582,5 +811,9 @@ struct mcu_driver __mcu_oled = {
 	.probe	= mcu_oled_probe,
 	.remove	= mcu_oled_remove,
 	.id_table	= mcu_oled_id,
+	.link_change	= mcu_oled_link_change,
+	.tx_class	= MCU_TX_BULK,
+	// 'Z' is not, a delta page would be applied twice
+	.retry_codes	= "FD",
 };
 
@@ -8,25 +8,66 @@
 
 #include <linux/spinlock.h>
 #include <linux/slab.h>
+#include <linux/kfifo.h>
+#include <linux/hashtable.h>
+#include <linux/moduleparam.h>
+#include <asm/unaligned.h>
 #include "mcu-packet.h"
+#include "mcu-event.h"
 #include "mcu-internal.h"
-
-/* recommended packet receive buffer size */
-#define MCU_PACKET_BUFFER_SIZE	512
+#define CREATE_TRACE_POINTS
+#include "mcu-trace.h"
+
+/* size of the receive ring between tty and detector, rounded up to power of 2 */
+static unsigned int rx_fifo_size = 4096;
+module_param(rx_fifo_size, uint, 0444);
+MODULE_PARM_DESC(rx_fifo_size, "size in bytes of the per bus receive ring");
+
+/* number of preallocated receive packets per bus */
+static unsigned int rx_packets = 16;
+module_param(rx_packets, uint, 0444);
+MODULE_PARM_DESC(rx_packets, "number of receive packets preallocated per bus");
+
+/* largest message carried by a segmented transfer */
+static unsigned int transfer_size = 2048;
+module_param(transfer_size, uint, 0444);
+MODULE_PARM_DESC(transfer_size, "max size in bytes of a segmented transfer");
+
+/* number of preallocated reassembly buffers per bus */
+static unsigned int rx_transfers = 2;
+module_param(rx_transfers, uint, 0444);
+MODULE_PARM_DESC(rx_transfers, "number of reassembly buffers preallocated per bus");
+
+/* number of preallocated max size transmit frames per bus */
+static unsigned int tx_frames = 8;
+module_param(tx_frames, uint, 0444);
+MODULE_PARM_DESC(tx_frames, "number of transmit frames preallocated per bus");
+
+/* max frames detected in one poll before the bus worker handles other events */
+static unsigned int rx_poll_budget = 16;
+module_param(rx_poll_budget, uint, 0644);
+MODULE_PARM_DESC(rx_poll_budget, "max frames detected per receive poll");
 
 #define MCU_PACKET_XOR	0xd8
 
+/* a tag is a byte, the transmit pool has no more frames than tags */
+#define MCU_PACKET_TAGS	256
+
 struct mcu_packet_header {
 #define MCU_PACKET_MAGIC0	0x4d
 	unsigned char magic0;
 #define MCU_PACKET_MAGIC1	0x43
 	unsigned char magic1;
-#define MCU_PACKET_MAX_LENGTH	250
 	unsigned char length;
 #define MCU_PACKET_PING	0x70
 #define MCU_PACKET_PONG	0x61
 #define MCU_PACKET_CONTROL_REQUEST	0x71
 #define MCU_PACKET_CONTROL_RESPONSE	0x72
+#define MCU_PACKET_TAGGED_REQUEST	0x73
+#define MCU_PACKET_TAGGED_RESPONSE	0x74
+#define MCU_PACKET_BATCH_REQUEST	0x75
+#define MCU_PACKET_BATCH_RESPONSE	0x76
+#define MCU_PACKET_SEGMENT	0x77
 	unsigned char identity;
 #define MCU_PACKET_CHECKSUM_NULL	0xff
 	unsigned char message_checksum;
@@ -44,32 +85,137 @@ struct mcu_packet_error_response {
 	unsigned char error_code;
 } __attribute__((packed));
 
+/* tagged control and error messages are prefixed with the tag of the request */
+struct mcu_packet_tagged_control {
+	unsigned char tag;
+	struct mcu_packet_device_control control;
+} __attribute__((packed));
+
+/* batch messages are a tag followed by entries of this, back to back */
+struct mcu_packet_batch_entry {
+	mcu_device_id device_id;
+	mcu_control_code control_code;
+	unsigned char length;
+	unsigned char detail[0];
+} __attribute__((packed));
+
+/*
+ * a message larger than a frame is sent as segments of one transfer,
+ * the first segment tells the identity and length of the whole message
+ */
+struct mcu_packet_segment {
+	unsigned char transfer_id;
+#define MCU_SEGMENT_FIRST	0x01
+#define MCU_SEGMENT_LAST	0x02
+	unsigned char flags;
+	union {
+		struct {
+			unsigned char identity;
+			__le16 length;
+			unsigned char data[0];
+		} __attribute__((packed)) first;
+		unsigned char data[0];
+	};
+} __attribute__((packed));
+
+#define MCU_SEGMENT_FIRST_SIZE	offsetof(struct mcu_packet_segment, first.data)
+#define MCU_SEGMENT_SIZE	offsetof(struct mcu_packet_segment, data)
+/* ms a segment waits for room in the transmit queue */
+#define MCU_PACKET_SEGMENT_TIMEOUT	1000
+
+/*
+ * requests in flight are looked up by the key of their response:
+ * the tag once negotiated, device id and control code otherwise
+ */
+#define MCU_PACKET_INFLIGHT_BITS	5
+#define MCU_PACKET_KEY_PONG	0x10000
+#define MCU_PACKET_KEY_TAG	0x20000
+#define MCU_PACKET_KEY_CONTROL	0x30000
+#define MCU_PACKET_KEY_TYPE	0xf0000
+
+struct mcu_packet_private;
+
+/*
+ * received packets are refcounted and come from a per bus pool,
+ * header and message form the wire image of the packet
+ */
 struct mcu_packet {
+	atomic_t refcount;
+	// NULL if not allocated from a receive pool
+	struct mcu_packet_private *pool;
+	struct list_head node;
+	// length of message, reassembled ones may exceed the frame limit
+	int length;
+	// capacity of message body
+	int size;
+	// reporting the packet never allocates
+	struct mcu_event event;
+
 	struct mcu_packet_header header;
+	// reassembly buffers extend the body up to transfer_size
 	union {
 		struct mcu_packet_device_control control;
 		struct mcu_packet_error_response error;
+		struct mcu_packet_tagged_control tagged;
+		unsigned char body[MCU_PACKET_MAX_LENGTH];
 	} message;
-} __attribute__((packed));
+};
 
 
 struct mcu_packet_private {
-	unsigned char buffer[MCU_PACKET_BUFFER_SIZE];
-	int buffer_start, buffer_end;
+	/*
+	 * single producer (tty receive) / single consumer (detector) ring,
+	 * the producer side never takes buffer_lock
+	 */
+	struct kfifo rx_fifo;
+
+	/* detector only, protected by buffer_lock */
+	enum {
+		MCU_PACKET_RX_SYNC0,	// waiting for magic0
+		MCU_PACKET_RX_SYNC1,	// waiting for magic1
+		MCU_PACKET_RX_HEADER,	// collecting rest of header
+		MCU_PACKET_RX_BODY,	// collecting message body
+		MCU_PACKET_RX_DISCARD,	// no free packet, skipping message body
+	} rx_state;
+	int rx_count;	// bytes of current header or body collected
+	int rx_sum;	// running checksum of message body
+	struct mcu_packet_header rx_header;
+	struct mcu_packet *rx_packet;	// packet the body is collected in
+	struct mcu_packet *rx_transfer;	// transfer being reassembled
+	unsigned char rx_transfer_id;
+	int rx_transfer_count;	// bytes of transfer collected
 	spinlock_t buffer_lock;
 
+	/* receive packet pool */
+	struct mcu_packet *rx_pool;
+	struct list_head rx_free;
+	spinlock_t rx_free_lock;
+	// reassembly buffers, free ones are kept in rx_transfer_free
+	struct mcu_packet **rx_transfer_pool;
+	struct list_head rx_transfer_free;
+
+	/* transmit frame pool */
+	struct mcu_tx_frame *tx_pool;
+	struct list_head tx_free;
+	spinlock_t tx_free_lock;
+	// tags of frames allocated and the next one to try, protected by tx_free_lock
+	DECLARE_BITMAP(tx_tags, MCU_PACKET_TAGS);
+	unsigned char tx_tag;
+	// requests waiting for a response, by key
+	DECLARE_HASHTABLE(tx_inflight, MCU_PACKET_INFLIGHT_BITS);
+	spinlock_t tx_inflight_lock;
+
+	/* segments of one transfer are written back to back */
+	struct mutex tx_transfer_lock;
+	unsigned char tx_transfer_id;
+
+	struct mcu_bus_stats *stats;
+	// owner, for tracing
+	struct mcu_bus_device *bus;
+
 	struct mcu_packet_callback *callback;
 };
 
-static int mcu_get_packet_length(struct mcu_packet *packet)
-{
-	if (unlikely(!packet)) {
-		return 0;
-	}
-
-	return sizeof(packet->header) + packet->header.length;
-}
-
 static unsigned char mcu_packet_get_checksum(void *buffer, int len)
 {
 	int i;
@@ -83,320 +229,1097 @@ static unsigned char mcu_packet_get_checksum(void *buffer, int len)
 	return sum & 0xff;
 }
 
-static void mcu_packet_header_fill(struct mcu_packet *packet)
-{
-	if (unlikely(!packet)) {
-		return;
-	}
-
-	packet->header.magic0 = MCU_PACKET_MAGIC0;
-	packet->header.magic1 = MCU_PACKET_MAGIC1;
-	packet->header.message_checksum = 0 == packet->header.length ? MCU_PACKET_CHECKSUM_NULL : mcu_packet_get_checksum(&packet->message, packet->header.length);
-	packet->header.header_checksum = mcu_packet_get_checksum(packet, sizeof(packet->header) - sizeof(packet->header.header_checksum));
-}
-
-
-static int mcu_packet_verify_checksum(struct mcu_packet *packet)
+static int mcu_packet_verify_header(struct mcu_packet_header *header)
 {
 	unsigned char checksum;
-	if (unlikely(!packet)) {
-		return 0;
-	}
 
-	if (unlikely(packet->header.length > MCU_PACKET_MAX_LENGTH)) {
+	if (unlikely(header->length > MCU_PACKET_MAX_LENGTH)) {
 		return 0;
 	}
 
-	checksum = mcu_packet_get_checksum(packet, sizeof(packet->header) - sizeof(packet->header.header_checksum));
-	if (unlikely(checksum != packet->header.header_checksum)) {
+	checksum = mcu_packet_get_checksum(header, sizeof(*header) - sizeof(header->header_checksum));
+	if (unlikely(checksum != header->header_checksum)) {
 		return 0;
 	}
 
-	checksum = 0 == packet->header.length ? MCU_PACKET_CHECKSUM_NULL : mcu_packet_get_checksum(&packet->message, packet->header.length);
-	if (unlikely(checksum != packet->header.message_checksum)) {
+	if (0 == header->length && MCU_PACKET_CHECKSUM_NULL != header->message_checksum) {
 		return 0;
 	}
 
 	return 1;
 }
 
-static int __mcu_packet_write(struct mcu_bus_device *bus, void *buffer, int count)
+static int __mcu_packet_write(struct mcu_bus_device *bus, void *buffer, int count, enum mcu_tx_class tx_class, int timeout)
 {
 	struct mcu_packet_private *mcu_packet_data = bus->pkt_data;
 	if (!mcu_packet_data || !mcu_packet_data->callback) {
 		return -EINVAL;
 	}
 
-	return mcu_packet_data->callback->write(bus, buffer, count);
+	return mcu_packet_data->callback->write(bus, buffer, count, tx_class, timeout);
 }
 
-static void __mcu_packet_do_xor(struct mcu_packet *packet)
+/*
+ * copy, checksum and xor the message body in one pass a word at a time,
+ * summing two bytes per 16 bit lane which can not overflow within a
+ * max size body
+ */
+static unsigned int __mcu_packet_encode_body(unsigned char *dst, const unsigned char *src, int len)
 {
-	int i, len = mcu_get_packet_length(packet);
-	unsigned char *cp = (unsigned char *)packet;
-	for (i = 0; i < len; i++) {
-		cp[i] ^= MCU_PACKET_XOR;
+	const u32 xor = MCU_PACKET_XOR * 0x01010101U;
+	u32 w, lanes = 0;
+	unsigned int sum;
+	int i;
+
+	for (i = 0; i + sizeof(u32) <= len; i += sizeof(u32)) {
+		w = get_unaligned((const u32 *)&src[i]);
+		lanes += (w & 0x00ff00ff) + ((w >> 8) & 0x00ff00ff);
+		put_unaligned(w ^ xor, (u32 *)&dst[i]);
 	}
+	sum = (lanes & 0xffff) + (lanes >> 16);
+
+	for (; i < len; i++) {
+		sum += src[i];
+		dst[i] = src[i] ^ MCU_PACKET_XOR;
+	}
+
+	return sum;
 }
 
-static int mcu_packet_send(struct mcu_bus_device *bus, struct mcu_packet *packet)
+static void __mcu_packet_encode_header(struct mcu_tx_frame *frame, int length, unsigned int sum)
 {
-	int len = mcu_get_packet_length(packet);
-	mcu_packet_header_fill(packet);
+	struct mcu_packet_header header;
+	unsigned char *hp = (unsigned char *)&header;
+	int i;
+
+	header.magic0 = MCU_PACKET_MAGIC0;
+	header.magic1 = MCU_PACKET_MAGIC1;
+	header.length = length;
+	header.identity = frame->identity;
+	header.message_checksum = 0 == length ? MCU_PACKET_CHECKSUM_NULL : sum & 0xff;
+	header.header_checksum = mcu_packet_get_checksum(&header, sizeof(header) - sizeof(header.header_checksum));
+	for (i = 0; i < sizeof(header); i++) {
+		frame->data[i] = hp[i] ^ MCU_PACKET_XOR;
+	}
+
+	frame->len = sizeof(header) + length;
+}
+
+/* build the xored wire image of a frame directly from the caller's buffer */
+static int mcu_packet_encode(struct mcu_tx_frame *frame, const void *cp, int len)
+{
+	unsigned char *body = &frame->data[MCU_PACKET_HEADER_SIZE];
+	unsigned int sum = 0;
+	int length = 0;
+
+	switch (frame->identity) {
+	case MCU_PACKET_TAGGED_REQUEST:
+		*body++ = frame->tag ^ MCU_PACKET_XOR;
+		sum = frame->tag;
+		length = sizeof(frame->tag);
+		// fall through
+	case MCU_PACKET_CONTROL_REQUEST:
+	case MCU_PACKET_CONTROL_RESPONSE:
+		if (unlikely(len < 0 || len > MCU_PACKET_MAX_LENGTH - length - sizeof(struct mcu_packet_device_control))) {
+			return -EMSGSIZE;
+		}
+		body[0] = frame->device_id ^ MCU_PACKET_XOR;
+		body[1] = frame->control_code ^ MCU_PACKET_XOR;
+		sum += frame->device_id + frame->control_code;
+		sum += __mcu_packet_encode_body(&body[sizeof(struct mcu_packet_device_control)], cp, len);
+		length += len + sizeof(struct mcu_packet_device_control);
+		break;
+	default:
+		break;
+	}
+
+	__mcu_packet_encode_header(frame, length, sum);
+	return 0;
+}
+
+/* pack as many commands as fit, the count is updated to the number packed */
+static int mcu_packet_encode_batch(struct mcu_tx_frame *frame, const struct mcu_command *cmds, int *count)
+{
+	unsigned char *body = &frame->data[MCU_PACKET_HEADER_SIZE];
+	unsigned int sum = frame->tag;
+	int i, length = sizeof(frame->tag);
+
+	body[0] = frame->tag ^ MCU_PACKET_XOR;
+	for (i = 0; i < *count; i++) {
+		int len = cmds[i].len;
+		if (len < 0 || length + sizeof(struct mcu_packet_batch_entry) + len > MCU_PACKET_MAX_LENGTH) {
+			break;
+		}
+		body[length] = frame->device_id ^ MCU_PACKET_XOR;
+		body[length + 1] = cmds[i].cmd ^ MCU_PACKET_XOR;
+		body[length + 2] = len ^ MCU_PACKET_XOR;
+		sum += frame->device_id + cmds[i].cmd + len;
+		length += sizeof(struct mcu_packet_batch_entry);
+		sum += __mcu_packet_encode_body(&body[length], cmds[i].buffer, len);
+		length += len;
+	}
+	if (unlikely(0 == i)) {
+		return -EMSGSIZE;
+	}
+
+	*count = i;
+	__mcu_packet_encode_header(frame, length, sum);
+	return 0;
+}
+
+/*
+ * unique among frames allocated, so no two requests in flight share a tag,
+ * taken round robin so a late response hardly finds its tag in use again
+ */
+static unsigned char __mcu_tx_tag_alloc(struct mcu_packet_private *mcu_packet_data)
+{
+	unsigned long tag;
+
+	tag = find_next_zero_bit(mcu_packet_data->tx_tags, MCU_PACKET_TAGS, mcu_packet_data->tx_tag);
+	if (tag >= MCU_PACKET_TAGS) {
+		tag = find_first_zero_bit(mcu_packet_data->tx_tags, MCU_PACKET_TAGS);
+	}
+	__set_bit(tag, mcu_packet_data->tx_tags);
+	mcu_packet_data->tx_tag = tag + 1;
+	return tag;
+}
+
+/* an empty pool is reported to the caller as backpressure, not waited on */
+static struct mcu_tx_frame *__mcu_tx_frame_alloc(struct mcu_packet_private *mcu_packet_data)
+{
+	struct mcu_tx_frame *frame = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mcu_packet_data->tx_free_lock, flags);
+	if (likely(!list_empty(&mcu_packet_data->tx_free))) {
+		frame = list_first_entry(&mcu_packet_data->tx_free, struct mcu_tx_frame, node);
+		list_del(&frame->node);
+		frame->tag = __mcu_tx_tag_alloc(mcu_packet_data);
+		frame->transfer = 0;
+	}
+	else {
+		mcu_packet_data->stats->tx_frame_exhausted++;
+	}
+	spin_unlock_irqrestore(&mcu_packet_data->tx_free_lock, flags);
+
+	return frame;
+}
+
+void mcu_tx_frame_free(struct mcu_tx_frame *frame)
+{
+	struct mcu_packet_private *pool;
+	unsigned long flags;
 
-	// after xor, package is damaged, mcu_get_packet_length() will get wrong result
-	__mcu_packet_do_xor(packet);
-	return __mcu_packet_write(bus, packet, len);
+	if (unlikely(!frame)) {
+		return;
+	}
+
+	pool = frame->pool;
+	// a response arriving from now on is unmatched
+	spin_lock_irqsave(&pool->tx_inflight_lock, flags);
+	if (frame->key) {
+		hash_del(&frame->inflight);
+		frame->key = 0;
+	}
+	spin_unlock_irqrestore(&pool->tx_inflight_lock, flags);
+	mcu_packet_put(frame->reply);
+	frame->reply = NULL;
+
+	spin_lock_irqsave(&pool->tx_free_lock, flags);
+	__clear_bit(frame->tag, pool->tx_tags);
+	list_add(&frame->node, &pool->tx_free);
+	spin_unlock_irqrestore(&pool->tx_free_lock, flags);
+}
+
+static unsigned int __mcu_packet_request_key(const struct mcu_tx_frame *frame)
+{
+	switch (frame->identity) {
+	case MCU_PACKET_PING:
+		return MCU_PACKET_KEY_PONG;
+	case MCU_PACKET_TAGGED_REQUEST:
+	case MCU_PACKET_BATCH_REQUEST:
+		return MCU_PACKET_KEY_TAG | frame->tag;
+	case MCU_PACKET_CONTROL_REQUEST:
+		return MCU_PACKET_KEY_CONTROL | frame->device_id << 8 | frame->control_code;
+	default:
+		return 0;
+	}
 }
 
-void mcu_packet_free(struct mcu_packet *packet)
+/* a request is in flight before it is queued, the response may come at any time after */
+static void __mcu_packet_expect(struct mcu_packet_private *mcu_packet_data, struct mcu_tx_frame *frame, void (*complete)(struct mcu_tx_frame *), void *context)
 {
-	kfree(packet);
+	unsigned long flags;
+
+	init_completion(&frame->done);
+	frame->reply = NULL;
+	frame->complete = complete;
+	frame->context = context;
+	frame->key = __mcu_packet_request_key(frame);
+	if (!frame->key) {
+		return;
+	}
+
+	spin_lock_irqsave(&mcu_packet_data->tx_inflight_lock, flags);
+	hash_add(mcu_packet_data->tx_inflight, &frame->inflight, frame->key);
+	spin_unlock_irqrestore(&mcu_packet_data->tx_inflight_lock, flags);
 }
 
-static struct mcu_packet *__mcu_packet_send_ping(struct mcu_bus_device *bus, unsigned char identity)
+/* queue an encoded frame, the frame is given back to the pool on error */
+static struct mcu_tx_frame *__mcu_packet_send(struct mcu_bus_device *bus, struct mcu_tx_frame *frame)
 {
 	int ret;
-	struct mcu_packet *packet;
 
-	if (unlikely(!bus)) {
-		return NULL;
+	ret = __mcu_packet_write(bus, frame->data, frame->len, frame->tx_class, 0);
+	if (unlikely(ret < frame->len)) {
+		mcu_tx_frame_free(frame);
+		return ERR_PTR(ret < 0 ? ret : -EIO);
 	}
 
-	packet = kzalloc(sizeof(struct mcu_packet), GFP_KERNEL);
-	if (unlikely(!packet)) {
-		return NULL;
+	trace_mcu_frame_tx(bus->nr, frame->identity, frame->device_id, frame->control_code, frame->len, frame->tag);
+	return frame;
+}
+
+/* xor and sum bytes [off, off + len) of the message made of prefix and detail */
+static unsigned int __mcu_packet_encode_span(unsigned char *dst, const unsigned char *prefix, int prefix_len, const unsigned char *cp, int off, int len)
+{
+	unsigned int sum = 0;
+
+	for (; len > 0 && off < prefix_len; len--, off++) {
+		sum += prefix[off];
+		*dst++ = prefix[off] ^ MCU_PACKET_XOR;
 	}
 
-	packet->header.identity = identity;
-	packet->header.length = 0;
+	return sum + __mcu_packet_encode_body(dst, &cp[off - prefix_len], len);
+}
 
-	ret = mcu_packet_send(bus, packet);
-	if (unlikely(ret < sizeof(struct mcu_packet_header))) {
-		kfree(packet);
-		packet = NULL;
+/*
+ * queue a message too large for one frame as segments of a transfer,
+ * back to back without waiting for the mcu, the frame is reused for each segment
+ */
+static int mcu_packet_send_transfer(struct mcu_bus_device *bus, struct mcu_tx_frame *frame, const void *cp, int len)
+{
+	struct mcu_packet_private *mcu_packet_data = bus->pkt_data;
+	unsigned char prefix[sizeof(struct mcu_packet_tagged_control)];
+	unsigned char *body = &frame->data[MCU_PACKET_HEADER_SIZE];
+	struct mcu_packet_segment segment;
+	int prefix_len = 0, total, off = 0, n, ret = 0;
+	unsigned int sum;
+
+	if (MCU_PACKET_TAGGED_REQUEST == frame->identity) {
+		prefix[prefix_len++] = frame->tag;
 	}
+	prefix[prefix_len++] = frame->device_id;
+	prefix[prefix_len++] = frame->control_code;
+	total = prefix_len + len;
 
-	return packet;
+	if (unlikely(!(bus->link_features & MCU_LINK_FEATURE_SEGMENT) || total > min(bus->link_transfer_size, transfer_size))) {
+		return -EMSGSIZE;
+	}
+
+	mutex_lock(&mcu_packet_data->tx_transfer_lock);
+	segment.transfer_id = mcu_packet_data->tx_transfer_id++;
+	segment.first.identity = frame->identity;
+	segment.first.length = cpu_to_le16(total);
+	segment.flags = MCU_SEGMENT_FIRST;
+
+	while (off < total) {
+		int head = MCU_SEGMENT_FIRST & segment.flags ? MCU_SEGMENT_FIRST_SIZE : MCU_SEGMENT_SIZE;
+		n = min(total - off, (int)(MCU_PACKET_MAX_LENGTH - head));
+		if (off + n == total) {
+			segment.flags |= MCU_SEGMENT_LAST;
+		}
+
+		sum = __mcu_packet_encode_body(body, (const unsigned char *)&segment, head);
+		sum += __mcu_packet_encode_span(&body[head], prefix, prefix_len, cp, off, n);
+		frame->identity = MCU_PACKET_SEGMENT;
+		__mcu_packet_encode_header(frame, head + n, sum);
+		frame->identity = segment.first.identity;
+
+		// a transfer cut short is lost, wait for the queue instead
+		ret = __mcu_packet_write(bus, frame->data, frame->len, frame->tx_class, MCU_PACKET_SEGMENT_TIMEOUT);
+		if (unlikely(ret < frame->len)) {
+			ret = ret < 0 ? ret : -EIO;
+			break;
+		}
+		trace_mcu_frame_tx(bus->nr, MCU_PACKET_SEGMENT, frame->device_id, frame->control_code, frame->len, frame->tag);
+		ret = 0;
+		off += n;
+		segment.flags = 0;
+	}
+	mutex_unlock(&mcu_packet_data->tx_transfer_lock);
+
+	return ret;
 }
 
-struct mcu_packet *mcu_packet_send_ping(struct mcu_bus_device *bus)
+static struct mcu_tx_frame *mcu_packet_send_frame(struct mcu_bus_device *bus, enum mcu_tx_class tx_class, unsigned char identity, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len, void (*complete)(struct mcu_tx_frame *), void *context)
 {
-	return __mcu_packet_send_ping(bus, MCU_PACKET_PING);
+	struct mcu_tx_frame *frame;
+	int ret;
+
+	if (unlikely(!bus || !bus->pkt_data)) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	frame = __mcu_tx_frame_alloc(bus->pkt_data);
+	if (unlikely(!frame)) {
+		return ERR_PTR(-EBUSY);
+	}
+
+	frame->identity = identity;
+	frame->tx_class = tx_class;
+	frame->device_id = device_id;
+	frame->control_code = control_code;
+	__mcu_packet_expect(bus->pkt_data, frame, complete, context);
+	ret = mcu_packet_encode(frame, cp, len);
+	if (-EMSGSIZE == ret && len > 0) {
+		ret = mcu_packet_send_transfer(bus, frame, cp, len);
+		if (likely(0 == ret)) {
+			frame->transfer = 1;
+			return frame;
+		}
+	}
+	if (unlikely(ret < 0)) {
+		mcu_tx_frame_free(frame);
+		return ERR_PTR(ret);
+	}
+
+	return __mcu_packet_send(bus, frame);
 }
 
-struct mcu_packet *mcu_packet_send_pong(struct mcu_bus_device *bus)
+/*
+ * only a tagged request sent whole, untagged ones are keyed by device and code
+ * so the answer to an earlier send could complete the next request instead
+ */
+int mcu_packet_can_resend(const struct mcu_tx_frame *frame)
 {
-	return __mcu_packet_send_ping(bus, MCU_PACKET_PONG);
+	return MCU_PACKET_TAGGED_REQUEST == frame->identity && !frame->transfer;
 }
 
-static struct mcu_packet *mcu_packet_send_control(struct mcu_bus_device *bus, unsigned char identity, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len)
+/* the frame stays in flight under the same tag */
+int mcu_packet_resend(struct mcu_bus_device *bus, struct mcu_tx_frame *frame)
 {
 	int ret;
-	unsigned char message_length = len + sizeof(struct mcu_packet_device_control);
-	struct mcu_packet *packet;
 
-	if (unlikely(!bus)) {
-		return NULL;
+	if (unlikely(!mcu_packet_can_resend(frame))) {
+		return -EINVAL;
+	}
+	ret = __mcu_packet_write(bus, frame->data, frame->len, frame->tx_class, 0);
+	if (unlikely(ret < frame->len)) {
+		return ret < 0 ? ret : -EIO;
 	}
 
-	packet = kzalloc(sizeof(struct mcu_packet) + message_length, GFP_KERNEL);
-	if (unlikely(!packet)) {
-		return NULL;
+	trace_mcu_frame_tx(bus->nr, frame->identity, frame->device_id, frame->control_code, frame->len, frame->tag);
+	return 0;
+}
+
+/* take a packet from rx_free, or a reassembly buffer from rx_transfer_free */
+static struct mcu_packet *__mcu_packet_alloc(struct mcu_packet_private *mcu_packet_data, struct list_head *free)
+{
+	struct mcu_packet *packet = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mcu_packet_data->rx_free_lock, flags);
+	if (!list_empty(free)) {
+		packet = list_first_entry(free, struct mcu_packet, node);
+		list_del(&packet->node);
 	}
+	spin_unlock_irqrestore(&mcu_packet_data->rx_free_lock, flags);
 
-	packet->header.identity = identity;
-	packet->header.length = message_length;
-	packet->message.control.device_id = device_id;
-	packet->message.control.control_code = control_code;
-	if (len) {
-		memcpy(&packet->message.control.detail, cp, len);
+	if (likely(packet)) {
+		atomic_set(&packet->refcount, 1);
+	}
+	return packet;
+}
+
+struct mcu_packet *mcu_packet_get(struct mcu_packet *packet)
+{
+	if (likely(packet)) {
+		atomic_inc(&packet->refcount);
+	}
+	return packet;
+}
+
+struct mcu_event *mcu_packet_event(struct mcu_packet *packet)
+{
+	return &packet->event;
+}
+
+void mcu_packet_put(struct mcu_packet *packet)
+{
+	struct mcu_packet_private *pool;
+	unsigned long flags;
+
+	if (!packet || !atomic_dec_and_test(&packet->refcount)) {
+		return;
 	}
 
-	ret = mcu_packet_send(bus, packet);
-	if (unlikely(ret < sizeof(struct mcu_packet_header) + message_length)) {
+	pool = packet->pool;
+	if (!pool) {
 		kfree(packet);
-		packet = NULL;
+		return;
 	}
 
-	return packet;
+	spin_lock_irqsave(&pool->rx_free_lock, flags);
+	list_add(&packet->node, packet->size > MCU_PACKET_MAX_LENGTH ? &pool->rx_transfer_free : &pool->rx_free);
+	spin_unlock_irqrestore(&pool->rx_free_lock, flags);
+}
+
+struct mcu_tx_frame *mcu_packet_send_ping(struct mcu_bus_device *bus)
+{
+	return mcu_packet_send_frame(bus, MCU_TX_URGENT, MCU_PACKET_PING, 0, 0, NULL, 0, NULL, NULL);
+}
+
+struct mcu_tx_frame *mcu_packet_send_pong(struct mcu_bus_device *bus)
+{
+	return mcu_packet_send_frame(bus, MCU_TX_URGENT, MCU_PACKET_PONG, 0, 0, NULL, 0, NULL, NULL);
+}
+
+/* tagged once negotiated with the mcu, so responses can be told apart */
+struct mcu_tx_frame *mcu_packet_send_control_request(struct mcu_bus_device *bus, enum mcu_tx_class tx_class, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len, void (*complete)(struct mcu_tx_frame *), void *context)
+{
+	unsigned char identity = MCU_PACKET_CONTROL_REQUEST;
+	if (bus && (bus->link_features & MCU_LINK_FEATURE_TAGGED)) {
+		identity = MCU_PACKET_TAGGED_REQUEST;
+	}
+	return mcu_packet_send_frame(bus, tx_class, identity, device_id, control_code, cp, len, complete, context);
 }
 
-struct mcu_packet *mcu_packet_send_control_request(struct mcu_bus_device *bus, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len)
+struct mcu_tx_frame *mcu_packet_send_control_response(struct mcu_bus_device *bus, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len)
 {
-	return mcu_packet_send_control(bus, MCU_PACKET_CONTROL_REQUEST, device_id, control_code, cp, len);
+	return mcu_packet_send_frame(bus, MCU_TX_NORMAL, MCU_PACKET_CONTROL_RESPONSE, device_id, control_code, cp, len, NULL, NULL);
 }
 
-struct mcu_packet *mcu_packet_send_control_response(struct mcu_bus_device *bus, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len)
+struct mcu_tx_frame *mcu_packet_send_batch_request(struct mcu_bus_device *bus, enum mcu_tx_class tx_class, mcu_device_id device_id, const struct mcu_command *cmds, int *count)
 {
-	return mcu_packet_send_control(bus, MCU_PACKET_CONTROL_RESPONSE, device_id, control_code, cp, len);
+	struct mcu_tx_frame *frame;
+	int ret;
+
+	if (unlikely(!bus || !bus->pkt_data)) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	frame = __mcu_tx_frame_alloc(bus->pkt_data);
+	if (unlikely(!frame)) {
+		return ERR_PTR(-EBUSY);
+	}
+
+	frame->identity = MCU_PACKET_BATCH_REQUEST;
+	frame->tx_class = tx_class;
+	frame->device_id = device_id;
+	frame->control_code = 0;
+	__mcu_packet_expect(bus->pkt_data, frame, NULL, NULL);
+	ret = mcu_packet_encode_batch(frame, cmds, count);
+	if (unlikely(ret < 0)) {
+		mcu_tx_frame_free(frame);
+		return ERR_PTR(ret);
+	}
+
+	return __mcu_packet_send(bus, frame);
+}
+
+static int mcu_packet_is_tagged(const struct mcu_packet *packet)
+{
+	return MCU_PACKET_TAGGED_REQUEST == packet->header.identity || MCU_PACKET_TAGGED_RESPONSE == packet->header.identity;
+}
+
+static struct mcu_packet_device_control *__mcu_packet_control(struct mcu_packet *packet)
+{
+	return mcu_packet_is_tagged(packet) ? &packet->message.tagged.control : &packet->message.control;
+}
+
+/* length of control detail, negative if the body is too short for a control message */
+static int __mcu_packet_detail_len(const struct mcu_packet *packet)
+{
+	int len = packet->length - sizeof(struct mcu_packet_device_control);
+	return mcu_packet_is_tagged(packet) ? len - sizeof(packet->message.tagged.tag) : len;
 }
 
 int mcu_packet_extract_control_info(struct mcu_packet *packet, mcu_device_id *device_id, mcu_control_code *control_code, int *detail_len)
 {
-	if (unlikely(!packet))
+	struct mcu_packet_device_control *control;
+
+	if (unlikely(!packet || __mcu_packet_detail_len(packet) < 0))
 		return -EINVAL;
 
-	if (device_id) *device_id = packet->message.control.device_id;
-	if (control_code) *control_code = packet->message.control.control_code;
-	if (detail_len) *detail_len = packet->header.length - sizeof(struct mcu_packet_device_control);
+	control = __mcu_packet_control(packet);
+	if (device_id) *device_id = control->device_id;
+	if (control_code) *control_code = control->control_code;
+	if (detail_len) *detail_len = __mcu_packet_detail_len(packet);
 
 	return 0;
 }
 
+/* tags of requests and responses are 0 to 255 */
+int mcu_packet_tag(struct mcu_packet *packet)
+{
+	switch (packet->header.identity) {
+	case MCU_PACKET_TAGGED_REQUEST:
+	case MCU_PACKET_TAGGED_RESPONSE:
+	case MCU_PACKET_BATCH_RESPONSE:
+		return packet->length > 0 ? packet->message.tagged.tag : -1;
+	default:
+		return -1;
+	}
+}
+
+unsigned char *mcu_packet_control_detail(struct mcu_packet *packet)
+{
+	return __mcu_packet_control(packet)->detail;
+}
+
 int mcu_packet_copy_control_detail(struct mcu_packet *packet, void *buffer, int *size)
 {
+	struct mcu_packet_device_control *control;
 	int len;
 	if (!packet || !buffer || !size) {
 		return -EFAULT;
 	}
-	// if is an error response
-	if (MCU_DEVICE_ERROR_ID == packet->message.error.error_id) {
-		return -packet->message.error.error_code;
+	if (unlikely(__mcu_packet_detail_len(packet) < 0)) {
+		return -EPROTO;
+	}
+	// if is an error response, laid out as device id and control code
+	control = __mcu_packet_control(packet);
+	if (MCU_DEVICE_ERROR_ID == control->device_id) {
+		return -control->control_code;
 	}
-	len = packet->header.length - sizeof(struct mcu_packet_device_control);
-	len = min(*size, len);
-	*size = packet->header.length - sizeof(struct mcu_packet_device_control);
+	len = min(*size, __mcu_packet_detail_len(packet));
+	*size = __mcu_packet_detail_len(packet);
 	if (len)
-		memcpy(buffer, packet->message.control.detail, len);
+		memcpy(buffer, control->detail, len);
 	return len;
 }
 
-int mcu_packet_response_to(const struct mcu_packet *req, const struct mcu_packet *resp)
+/*
+ * hand out the entries of a batch response in request order,
+ * a single error entry applies to the whole batch,
+ * entries answer device_id as the whole batch was sent to it
+ */
+int mcu_packet_copy_batch_detail(struct mcu_packet *packet, mcu_device_id device_id, struct mcu_command *cmds, int count)
 {
-	unsigned char req_type, resp_type;
-	mcu_device_id req_id, resp_id;
-	mcu_control_code req_cmd;
-	if (!req || !resp) return 0;
-	req_type = req->header.identity ^ MCU_PACKET_XOR;
-	resp_type = resp->header.identity;
-	// for ping and pong, no further check
-	if (MCU_PACKET_PING == req_type && MCU_PACKET_PONG == resp_type) return 1;
-	if (MCU_PACKET_CONTROL_REQUEST != req_type || MCU_PACKET_CONTROL_RESPONSE != MCU_PACKET_CONTROL_RESPONSE) return 0;
-	resp_id = resp->message.control.device_id;
-	if (MCU_DEVICE_ERROR_ID == resp_id) return 1;
-	// request packet content is xored
-	req_id = req->message.control.device_id ^ MCU_PACKET_XOR;
-	req_cmd = req->message.control.control_code ^ MCU_PACKET_XOR;
-	return (req_id == resp_id) && (req_cmd == resp->message.control.control_code);
+	const unsigned char *body = packet->message.body;
+	const struct mcu_packet_batch_entry *entry;
+	int i, offset = sizeof(packet->message.tagged.tag);
+
+	entry = (const struct mcu_packet_batch_entry *)&body[offset];
+	if (count > 1 && packet->length == offset + sizeof(*entry) && MCU_DEVICE_ERROR_ID == entry->device_id) {
+		for (i = 0; i < count; i++) {
+			cmds[i].ret = -entry->control_code;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		entry = (const struct mcu_packet_batch_entry *)&body[offset];
+		if (unlikely(offset + sizeof(*entry) > packet->length ||
+				offset + sizeof(*entry) + entry->length > packet->length)) {
+			cmds[i].ret = -EPROTO;
+			continue;
+		}
+		offset += sizeof(*entry) + entry->length;
+
+		if (MCU_DEVICE_ERROR_ID == entry->device_id) {
+			cmds[i].ret = -entry->control_code;
+		}
+		else if (unlikely(entry->device_id != device_id || entry->control_code != cmds[i].cmd)) {
+			cmds[i].ret = -EPROTO;
+		}
+		else if (entry->length > cmds[i].len) {
+			// buffer too small
+			memcpy(cmds[i].buffer, entry->detail, cmds[i].len);
+			cmds[i].ret = -ENOSPC;
+		}
+		else {
+			memcpy(cmds[i].buffer, entry->detail, entry->length);
+			cmds[i].ret = entry->length;
+		}
+	}
+
+	return 0;
 }
 
+struct mcu_packet *mcu_packet_wait_response(struct mcu_tx_frame *frame, int timeout)
+{
+	long ret;
+
+	ret = wait_for_completion_interruptible_timeout(&frame->done, msecs_to_jiffies(timeout));
+	if (ret <= 0) {
+		return ERR_PTR(ret < 0 ? ret : -ETIME);
+	}
 
-static int __mcu_packet_empty(struct mcu_packet_private *mcu_packet_data)
+	return mcu_packet_take_response(frame);
+}
+
+struct mcu_packet *mcu_packet_take_response(struct mcu_tx_frame *frame)
 {
-	return mcu_packet_data->buffer_start == mcu_packet_data->buffer_end;
+	struct mcu_packet *reply;
+
+	if (!completion_done(&frame->done)) {
+		return NULL;
+	}
+
+	// completed only after the reply is set
+	reply = frame->reply;
+	frame->reply = NULL;
+	return reply;
 }
 
-static int __mcu_packet_buffer_size(struct mcu_packet_private *mcu_packet_data)
+/* deepest window of tagged requests the transmit pool can keep in flight */
+int mcu_packet_tx_window_max(struct mcu_bus_device *bus)
 {
-	return mcu_packet_data->buffer_end - mcu_packet_data->buffer_start;
+	// one frame is kept for pong
+	return clamp_t(unsigned int, tx_frames, 2, MCU_PACKET_TAGS) - 1;
 }
 
-static void __mcu_packet_buffer_reset(struct mcu_packet_private *mcu_packet_data)
+/* largest segmented transfer that can be reassembled */
+int mcu_packet_transfer_size_max(struct mcu_bus_device *bus)
 {
-	if (likely(mcu_packet_data->buffer_start < MCU_PACKET_BUFFER_SIZE / 2)) {
-		return;
+	return rx_transfers ? transfer_size : MCU_PACKET_MAX_LENGTH;
+}
+
+
+static struct mcu_packet *__mcu_packet_parse_byte(struct mcu_packet_private *mcu_packet_data, unsigned char c);
+
+/*
+ * header check failed, the magic at offset 0 is known to be bad,
+ * restart from the next magic0 already collected
+ */
+static void __mcu_packet_resync(struct mcu_packet_private *mcu_packet_data)
+{
+	unsigned char header[sizeof(struct mcu_packet_header)];
+	int i, len = mcu_packet_data->rx_count;
+
+	memcpy(header, &mcu_packet_data->rx_header, len);
+	mcu_packet_data->rx_state = MCU_PACKET_RX_SYNC0;
+
+	for (i = 1; i < len; i++) {
+		if (MCU_PACKET_MAGIC0 == header[i]) {
+			break;
+		}
+	}
+	mcu_packet_data->stats->rx_resync_bytes += i;
+	trace_mcu_rx_resync(mcu_packet_data->bus->nr, i);
+
+	// less than a header is replayed, so no packet can be completed here
+	for (; i < len; i++) {
+		__mcu_packet_parse_byte(mcu_packet_data, header[i]);
 	}
-	mcu_packet_data->buffer_start = 0;
-	mcu_packet_data->buffer_end = 0;
 }
 
-static void __mcu_packet_buffer_consume(struct mcu_packet_private *mcu_packet_data, int count)
+/* a valid header is collected, move it into a packet from the pool */
+static struct mcu_packet *__mcu_packet_parse_header(struct mcu_packet_private *mcu_packet_data)
 {
-	mcu_packet_data->buffer_start += count;
-	if (__mcu_packet_empty(mcu_packet_data)) {
-		__mcu_packet_buffer_reset(mcu_packet_data);
+	struct mcu_packet_header *header = &mcu_packet_data->rx_header;
+	struct mcu_packet *packet;
+
+	packet = __mcu_packet_alloc(mcu_packet_data, &mcu_packet_data->rx_free);
+	if (unlikely(!packet)) {
+		mcu_packet_data->stats->rx_packet_dropped++;
+		mcu_packet_data->rx_count = header->length;
+		mcu_packet_data->rx_state = header->length ? MCU_PACKET_RX_DISCARD : MCU_PACKET_RX_SYNC0;
+		return NULL;
+	}
+
+	memcpy(&packet->header, header, sizeof(*header));
+	packet->length = header->length;
+	if (0 == header->length) {
+		mcu_packet_data->rx_state = MCU_PACKET_RX_SYNC0;
+		return packet;
 	}
+
+	mcu_packet_data->rx_packet = packet;
+	mcu_packet_data->rx_count = 0;
+	mcu_packet_data->rx_sum = 0;
+	mcu_packet_data->rx_state = MCU_PACKET_RX_BODY;
+	return NULL;
 }
 
+/* feed one byte of magic or header, return the packet if a body-less packet completed */
+static struct mcu_packet *__mcu_packet_parse_byte(struct mcu_packet_private *mcu_packet_data, unsigned char c)
+{
+	unsigned char *cp = (unsigned char *)&mcu_packet_data->rx_header;
+
+	switch (mcu_packet_data->rx_state) {
+	case MCU_PACKET_RX_SYNC0:
+		if (MCU_PACKET_MAGIC0 == c) {
+			cp[0] = c;
+			mcu_packet_data->rx_count = 1;
+			mcu_packet_data->rx_state = MCU_PACKET_RX_SYNC1;
+		}
+		else {
+			mcu_packet_data->stats->rx_resync_bytes++;
+		}
+		break;
+	case MCU_PACKET_RX_SYNC1:
+		if (MCU_PACKET_MAGIC1 == c) {
+			cp[1] = c;
+			mcu_packet_data->rx_count = 2;
+			mcu_packet_data->rx_state = MCU_PACKET_RX_HEADER;
+		}
+		else if (MCU_PACKET_MAGIC0 != c) {
+			// magic0 and this byte
+			mcu_packet_data->stats->rx_resync_bytes += 2;
+			mcu_packet_data->rx_state = MCU_PACKET_RX_SYNC0;
+		}
+		else {
+			mcu_packet_data->stats->rx_resync_bytes++;
+		}
+		break;
+	case MCU_PACKET_RX_HEADER:
+		cp[mcu_packet_data->rx_count++] = c;
+		if (mcu_packet_data->rx_count < sizeof(struct mcu_packet_header)) {
+			break;
+		}
+		if (unlikely(!mcu_packet_verify_header(&mcu_packet_data->rx_header))) {
+			mcu_packet_data->stats->rx_header_errors++;
+			__mcu_packet_resync(mcu_packet_data);
+			break;
+		}
+		return __mcu_packet_parse_header(mcu_packet_data);
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+/* copy as much of the message body as available, checksum while de-xoring */
+static int __mcu_packet_parse_body(struct mcu_packet_private *mcu_packet_data)
+{
+	struct mcu_packet *packet = mcu_packet_data->rx_packet;
+	unsigned char *cp = packet->message.body;
+	int i, len, end;
+
+	len = kfifo_out(&mcu_packet_data->rx_fifo, &cp[mcu_packet_data->rx_count], packet->length - mcu_packet_data->rx_count);
+	end = mcu_packet_data->rx_count + len;
+	for (i = mcu_packet_data->rx_count; i < end; i++) {
+		cp[i] ^= MCU_PACKET_XOR;
+		mcu_packet_data->rx_sum += cp[i];
+	}
+	mcu_packet_data->rx_count = end;
+
+	return len;
+}
+
+/*
+ * resumable detector, every received byte is looked at once,
+ * return NULL when the receive ring is drained
+ */
 static struct mcu_packet * __mcu_packet_detect(struct mcu_packet_private *mcu_packet_data)
 {
-	int i;
 	struct mcu_packet *packet;
+	unsigned char c;
+
+	while (1) {
+		switch (mcu_packet_data->rx_state) {
+		case MCU_PACKET_RX_BODY:
+			if (!__mcu_packet_parse_body(mcu_packet_data)) {
+				return NULL;
+			}
+			packet = mcu_packet_data->rx_packet;
+			if (mcu_packet_data->rx_count < packet->length) {
+				continue;
+			}
+			mcu_packet_data->rx_packet = NULL;
+			mcu_packet_data->rx_state = MCU_PACKET_RX_SYNC0;
+			if (unlikely((mcu_packet_data->rx_sum & 0xff) != packet->header.message_checksum)) {
+				mcu_packet_data->stats->rx_checksum_errors++;
+				trace_mcu_rx_checksum(mcu_packet_data->bus->nr, packet->header.identity, packet->length);
+				mcu_packet_put(packet);
+				continue;
+			}
+			return packet;
+		case MCU_PACKET_RX_DISCARD:
+			if (!kfifo_get(&mcu_packet_data->rx_fifo, &c)) {
+				return NULL;
+			}
+			if (0 == --mcu_packet_data->rx_count) {
+				mcu_packet_data->rx_state = MCU_PACKET_RX_SYNC0;
+			}
+			continue;
+		default:
+			if (!kfifo_get(&mcu_packet_data->rx_fifo, &c)) {
+				return NULL;
+			}
+			packet = __mcu_packet_parse_byte(mcu_packet_data, c ^ MCU_PACKET_XOR);
+			if (packet) {
+				return packet;
+			}
+			continue;
+		}
+	}
+}
 
-	if (__mcu_packet_buffer_size(mcu_packet_data) < sizeof(struct mcu_packet_header)) {
-		// smaller than a packet header, ignore
+static void __mcu_packet_transfer_drop(struct mcu_packet_private *mcu_packet_data)
+{
+	mcu_packet_data->stats->rx_transfer_dropped++;
+	mcu_packet_put(mcu_packet_data->rx_transfer);
+	mcu_packet_data->rx_transfer = NULL;
+}
+
+/*
+ * collect a segment into the transfer being reassembled,
+ * return the reassembled message once the last segment arrived
+ */
+static struct mcu_packet *__mcu_packet_reassemble(struct mcu_packet_private *mcu_packet_data, struct mcu_packet *packet)
+{
+	const struct mcu_packet_segment *segment = (const struct mcu_packet_segment *)packet->message.body;
+	struct mcu_packet *transfer;
+	const unsigned char *data;
+	int len;
+
+	if (unlikely(packet->length < MCU_SEGMENT_SIZE)) {
 		return NULL;
 	}
 
-	for (i = mcu_packet_data->buffer_start; i < mcu_packet_data->buffer_end - 1; i++) {
-		if (MCU_PACKET_MAGIC0 == mcu_packet_data->buffer[i] && MCU_PACKET_MAGIC1 == mcu_packet_data->buffer[i + 1]) {
-			packet = (struct mcu_packet *)&mcu_packet_data->buffer[i];
-			if (mcu_packet_verify_checksum(packet)) {
-				// ignore if buffer to small
-				if (i + mcu_get_packet_length(packet) > mcu_packet_data->buffer_end) {
-					packet = NULL;
-					continue;
-				}
-				__mcu_packet_buffer_consume(mcu_packet_data, i + mcu_get_packet_length(packet) - mcu_packet_data->buffer_start);
-				return packet;
+	if (segment->flags & MCU_SEGMENT_FIRST) {
+		// a new transfer aborts an unfinished one
+		if (unlikely(mcu_packet_data->rx_transfer)) {
+			__mcu_packet_transfer_drop(mcu_packet_data);
+		}
+		if (unlikely(packet->length < MCU_SEGMENT_FIRST_SIZE || le16_to_cpu(segment->first.length) > transfer_size)) {
+			mcu_packet_data->stats->rx_transfer_dropped++;
+			return NULL;
+		}
+		transfer = __mcu_packet_alloc(mcu_packet_data, &mcu_packet_data->rx_transfer_free);
+		if (unlikely(!transfer)) {
+			mcu_packet_data->stats->rx_transfer_dropped++;
+			return NULL;
+		}
+		transfer->header = packet->header;
+		transfer->header.identity = segment->first.identity;
+		transfer->length = le16_to_cpu(segment->first.length);
+		mcu_packet_data->rx_transfer = transfer;
+		mcu_packet_data->rx_transfer_id = segment->transfer_id;
+		mcu_packet_data->rx_transfer_count = 0;
+		data = segment->first.data;
+		len = packet->length - MCU_SEGMENT_FIRST_SIZE;
+	}
+	else {
+		if (unlikely(!mcu_packet_data->rx_transfer || mcu_packet_data->rx_transfer_id != segment->transfer_id)) {
+			// lost the first segment
+			mcu_packet_data->stats->rx_transfer_dropped++;
+			return NULL;
+		}
+		data = segment->data;
+		len = packet->length - MCU_SEGMENT_SIZE;
+	}
+
+	transfer = mcu_packet_data->rx_transfer;
+	if (unlikely(mcu_packet_data->rx_transfer_count + len > transfer->length)) {
+		__mcu_packet_transfer_drop(mcu_packet_data);
+		return NULL;
+	}
+	memcpy(&transfer->message.body[mcu_packet_data->rx_transfer_count], data, len);
+	mcu_packet_data->rx_transfer_count += len;
+
+	if (!(segment->flags & MCU_SEGMENT_LAST)) {
+		return NULL;
+	}
+	if (unlikely(mcu_packet_data->rx_transfer_count != transfer->length)) {
+		__mcu_packet_transfer_drop(mcu_packet_data);
+		return NULL;
+	}
+	mcu_packet_data->rx_transfer = NULL;
+	return transfer;
+}
+
+/* 0 if the response can not be matched to any request */
+static unsigned int __mcu_packet_response_key(const struct mcu_packet *packet)
+{
+	switch (packet->header.identity) {
+	case MCU_PACKET_PONG:
+		return MCU_PACKET_KEY_PONG;
+	case MCU_PACKET_TAGGED_RESPONSE:
+	case MCU_PACKET_BATCH_RESPONSE:
+		// including errors, matched by tag only
+		return packet->length > 0 ? MCU_PACKET_KEY_TAG | packet->message.tagged.tag : 0;
+	case MCU_PACKET_CONTROL_RESPONSE:
+		if (packet->length < sizeof(struct mcu_packet_device_control)) {
+			return 0;
+		}
+		return MCU_PACKET_KEY_CONTROL | packet->message.control.device_id << 8 | packet->message.control.control_code;
+	default:
+		return 0;
+	}
+}
+
+/* hand the response to the one request waiting for it, return 0 if there is none */
+static int __mcu_packet_complete(struct mcu_packet_private *mcu_packet_data, struct mcu_packet *packet)
+{
+	struct mcu_tx_frame *frame, *found = NULL;
+	unsigned int key = __mcu_packet_response_key(packet);
+	unsigned long flags;
+	int bkt;
+
+	if (unlikely(!key)) {
+		return 0;
+	}
+
+	spin_lock_irqsave(&mcu_packet_data->tx_inflight_lock, flags);
+	if (MCU_PACKET_KEY_CONTROL == (key & MCU_PACKET_KEY_TYPE) && MCU_DEVICE_ERROR_ID == packet->message.control.device_id) {
+		// untagged errors do not tell the request, it is the only one in flight
+		hash_for_each(mcu_packet_data->tx_inflight, bkt, frame, inflight) {
+			if (MCU_PACKET_KEY_CONTROL == (frame->key & MCU_PACKET_KEY_TYPE)) {
+				found = frame;
+				break;
 			}
 		}
 	}
+	else {
+		hash_for_each_possible(mcu_packet_data->tx_inflight, frame, inflight, key) {
+			if (frame->key == key) {
+				found = frame;
+				break;
+			}
+		}
+	}
+	if (found) {
+		hash_del(&found->inflight);
+		found->key = 0;
+		found->reply = mcu_packet_get(packet);
+		trace_mcu_response_wake(mcu_packet_data->bus->nr, packet->header.identity, found->device_id, found->control_code, packet->length, found->tag);
+		// under the lock, the frame is not freed meanwhile
+		if (found->complete) {
+			found->complete(found);
+		}
+		complete(&found->done);
+	}
+	spin_unlock_irqrestore(&mcu_packet_data->tx_inflight_lock, flags);
 
-	// not found, try to reset buffer
-	//__mcu_packet_buffer_consume(i - mcu_packet_data->buffer_start);
+	return found != NULL;
+}
 
-	return NULL;
+static void __mcu_packet_trace_rx(struct mcu_bus_device *bus, struct mcu_packet *packet)
+{
+	mcu_device_id device_id = 0;
+	mcu_control_code control_code = 0;
+
+	// batch responses are made of entries
+	if (MCU_PACKET_BATCH_RESPONSE != packet->header.identity) {
+		mcu_packet_extract_control_info(packet, &device_id, &control_code, NULL);
+	}
+	trace_mcu_frame_rx(bus->nr, packet->header.identity, device_id, control_code, packet->length, mcu_packet_tag(packet));
 }
 
 static void __mcu_packet_report(struct mcu_bus_device *bus, struct mcu_packet *packet)
 {
 	struct mcu_packet_private *mcu_packet_data = bus->pkt_data;
+
+	if (trace_mcu_frame_rx_enabled()) {
+		__mcu_packet_trace_rx(bus, packet);
+	}
 	switch (packet->header.identity) {
 	case MCU_PACKET_PING:
 		mcu_packet_data->callback->ping(bus, packet);
 		break;
-	case MCU_PACKET_PONG:
-		mcu_packet_data->callback->pong(bus, packet);
-		break;
 	case MCU_PACKET_CONTROL_REQUEST:
+	case MCU_PACKET_TAGGED_REQUEST:
 		mcu_packet_data->callback->new_request(bus, packet);
 		break;
+	case MCU_PACKET_PONG:
 	case MCU_PACKET_CONTROL_RESPONSE:
-		mcu_packet_data->callback->new_response(bus, packet);
+	case MCU_PACKET_TAGGED_RESPONSE:
+	case MCU_PACKET_BATCH_RESPONSE:
+		// late, duplicated or corrupted responses are released right away
+		if (!__mcu_packet_complete(mcu_packet_data, packet)) {
+			mcu_packet_data->stats->rx_response_unmatched++;
+		}
 		break;
 	default:
 		break;
 	}
 }
 
-void mcu_packet_buffer_detect(struct mcu_bus_device *bus)
+/* buffer_lock held */
+static int __mcu_packet_poll(struct mcu_bus_device *bus, struct mcu_packet_private *mcu_packet_data)
+{
+	struct mcu_bus_stats *stats = mcu_packet_data->stats;
+	unsigned int budget = max(READ_ONCE(rx_poll_budget), 1U);
+	unsigned int frames = 0;
+
+	while (frames < budget) {
+		struct mcu_packet *packet = __mcu_packet_detect(mcu_packet_data);
+		if (!packet) {
+			break;
+		}
+		frames++;
+		if (MCU_PACKET_SEGMENT == packet->header.identity) {
+			struct mcu_packet *transfer = __mcu_packet_reassemble(mcu_packet_data, packet);
+			mcu_packet_put(packet);
+			packet = transfer;
+			if (!packet) {
+				continue;
+			}
+		}
+		// callbacks take their own reference if they keep the packet
+		__mcu_packet_report(bus, packet);
+		mcu_packet_put(packet);
+	}
+
+	stats->rx_polls++;
+	stats->rx_frames += frames;
+	stats->rx_poll_frames += frames;
+	if (frames > stats->rx_poll_frames_max) {
+		stats->rx_poll_frames_max = frames;
+	}
+	if (frames < budget) {
+		return 0;
+	}
+	stats->rx_poll_exhausted++;
+	return 1;
+}
+
+int mcu_packet_buffer_detect(struct mcu_bus_device *bus)
 {
 	struct mcu_packet_private *mcu_packet_data = bus->pkt_data;
+	int ret;
 	if (unlikely(!mcu_packet_data)) {
-		return;
+		return 0;
 	}
 
 	spin_lock(&mcu_packet_data->buffer_lock);
-	while (1) {
-		struct mcu_packet *packet = __mcu_packet_detect(mcu_packet_data);
-		if (packet) {
-			__mcu_packet_report(bus, packet);
-		}
-		else {
-			break;
-		}
+	ret = __mcu_packet_poll(bus, mcu_packet_data);
+	spin_unlock(&mcu_packet_data->buffer_lock);
+	return ret;
+}
+
+int mcu_packet_buffer_try_detect(struct mcu_bus_device *bus)
+{
+	struct mcu_packet_private *mcu_packet_data = bus->pkt_data;
+	int ret;
+	if (unlikely(!mcu_packet_data)) {
+		return 0;
+	}
+
+	// never spin here, the receive context may hold locks of the backend
+	if (!spin_trylock(&mcu_packet_data->buffer_lock)) {
+		return -EBUSY;
 	}
+	mcu_packet_data->stats->rx_direct_polls++;
+	ret = __mcu_packet_poll(bus, mcu_packet_data);
 	spin_unlock(&mcu_packet_data->buffer_lock);
+	return ret;
 }
 
+/* producer side of the receive ring, must not be called concurrently */
 static int mcu_packet_append(struct mcu_packet_private *mcu_packet_data, const unsigned char *cp, int count)
 {
-	int len = 0;
+	unsigned int len, used;
 	if (unlikely(!mcu_packet_data)) {
 		return -EINVAL;
 	}
 
-	spin_lock(&mcu_packet_data->buffer_lock);
-	{
-		int i;
-		len = min(count, MCU_PACKET_BUFFER_SIZE - mcu_packet_data->buffer_end);
-		for (i = 0; i < len; i++) {
-			mcu_packet_data->buffer[mcu_packet_data->buffer_end++] = cp[i] ^ MCU_PACKET_XOR;
-		}
+	mcu_packet_data->stats->rx_bytes += count;
+	len = kfifo_in(&mcu_packet_data->rx_fifo, cp, count);
+	if (unlikely(len < count)) {
+		mcu_packet_data->stats->rx_overrun_bytes += count - len;
+	}
+
+	used = kfifo_len(&mcu_packet_data->rx_fifo);
+	if (used > mcu_packet_data->stats->rx_fifo_high_watermark) {
+		mcu_packet_data->stats->rx_fifo_high_watermark = used;
 	}
-	spin_unlock(&mcu_packet_data->buffer_lock);
 
 	return len;
 }
@@ -410,22 +1333,108 @@ int mcu_packet_receive_buffer(struct mcu_bus_device *bus, const void *cp, int co
 int __init mcu_packet_init(struct mcu_bus_device *bus, struct mcu_packet_callback *callback)
 {
 	struct mcu_packet_private *mcu_packet_data;
+	int i, ret;
+
+	BUILD_BUG_ON(sizeof(struct mcu_packet_header) != MCU_PACKET_HEADER_SIZE);
 
 	mcu_packet_data = kzalloc(sizeof(*mcu_packet_data), GFP_KERNEL);
 	if (unlikely(!mcu_packet_data)) {
 		return -ENOMEM;
 	}
 	mcu_packet_data->callback = callback;
+	mcu_packet_data->stats = &bus->stats;
+	mcu_packet_data->bus = bus;
+
+	// kfifo_alloc() rounds up to a power of 2
+	ret = kfifo_alloc(&mcu_packet_data->rx_fifo, max(rx_fifo_size, (unsigned int)sizeof(struct mcu_packet)), GFP_KERNEL);
+	if (unlikely(ret)) {
+		goto exit_free_data;
+	}
+	bus->stats.rx_fifo_size = kfifo_size(&mcu_packet_data->rx_fifo);
 
 	spin_lock_init(&mcu_packet_data->buffer_lock);
 
+	INIT_LIST_HEAD(&mcu_packet_data->rx_free);
+	spin_lock_init(&mcu_packet_data->rx_free_lock);
+	mcu_packet_data->rx_pool = kcalloc(max(rx_packets, 1U), sizeof(struct mcu_packet), GFP_KERNEL);
+	if (unlikely(!mcu_packet_data->rx_pool)) {
+		ret = -ENOMEM;
+		goto exit_free_fifo;
+	}
+	for (i = 0; i < max(rx_packets, 1U); i++) {
+		mcu_packet_data->rx_pool[i].pool = mcu_packet_data;
+		mcu_packet_data->rx_pool[i].size = MCU_PACKET_MAX_LENGTH;
+		list_add_tail(&mcu_packet_data->rx_pool[i].node, &mcu_packet_data->rx_free);
+	}
+
+	// segmented transfers carry a 16 bit length
+	transfer_size = clamp(transfer_size, (unsigned int)MCU_PACKET_MAX_LENGTH + 1, 65535U);
+	INIT_LIST_HEAD(&mcu_packet_data->rx_transfer_free);
+	mcu_packet_data->rx_transfer_pool = kcalloc(rx_transfers, sizeof(struct mcu_packet *), GFP_KERNEL);
+	if (unlikely(rx_transfers && !mcu_packet_data->rx_transfer_pool)) {
+		ret = -ENOMEM;
+		goto exit_free_rx_pool;
+	}
+	for (i = 0; i < rx_transfers; i++) {
+		struct mcu_packet *transfer = kzalloc(offsetof(struct mcu_packet, message) + transfer_size, GFP_KERNEL);
+		if (unlikely(!transfer)) {
+			ret = -ENOMEM;
+			goto exit_free_transfer_pool;
+		}
+		transfer->pool = mcu_packet_data;
+		transfer->size = transfer_size;
+		list_add_tail(&transfer->node, &mcu_packet_data->rx_transfer_free);
+		mcu_packet_data->rx_transfer_pool[i] = transfer;
+	}
+
+	INIT_LIST_HEAD(&mcu_packet_data->tx_free);
+	mutex_init(&mcu_packet_data->tx_transfer_lock);
+	spin_lock_init(&mcu_packet_data->tx_free_lock);
+	hash_init(mcu_packet_data->tx_inflight);
+	spin_lock_init(&mcu_packet_data->tx_inflight_lock);
+	mcu_packet_data->tx_pool = kcalloc(clamp_t(unsigned int, tx_frames, 1, MCU_PACKET_TAGS), sizeof(struct mcu_tx_frame), GFP_KERNEL);
+	if (unlikely(!mcu_packet_data->tx_pool)) {
+		ret = -ENOMEM;
+		goto exit_free_transfer_pool;
+	}
+	for (i = 0; i < clamp_t(unsigned int, tx_frames, 1, MCU_PACKET_TAGS); i++) {
+		mcu_packet_data->tx_pool[i].pool = mcu_packet_data;
+		list_add_tail(&mcu_packet_data->tx_pool[i].node, &mcu_packet_data->tx_free);
+	}
+
 	bus->pkt_data = mcu_packet_data;
 	return 0;
+
+exit_free_transfer_pool:
+	for (i = 0; i < rx_transfers; i++) {
+		kfree(mcu_packet_data->rx_transfer_pool[i]);
+	}
+	kfree(mcu_packet_data->rx_transfer_pool);
+exit_free_rx_pool:
+	kfree(mcu_packet_data->rx_pool);
+exit_free_fifo:
+	kfifo_free(&mcu_packet_data->rx_fifo);
+exit_free_data:
+	kfree(mcu_packet_data);
+	return ret;
 }
 
 void __exit mcu_packet_deinit(struct mcu_bus_device *bus)
 {
-	kfree(bus->pkt_data);
+	struct mcu_packet_private *mcu_packet_data = bus->pkt_data;
+	int i;
+
+	if (mcu_packet_data) {
+		mcu_packet_put(mcu_packet_data->rx_packet);
+		kfree(mcu_packet_data->tx_pool);
+		for (i = 0; i < rx_transfers; i++) {
+			kfree(mcu_packet_data->rx_transfer_pool[i]);
+		}
+		kfree(mcu_packet_data->rx_transfer_pool);
+		kfree(mcu_packet_data->rx_pool);
+		kfifo_free(&mcu_packet_data->rx_fifo);
+	}
+	kfree(mcu_packet_data);
 	bus->pkt_data = NULL;
 }
 
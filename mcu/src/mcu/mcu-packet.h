@@ -11,49 +11,105 @@
 #define __MCU_PACK_H_
 
 #include <linux/init.h>
+#include <linux/completion.h>
 #include "linux/mcu.h"
 
-// offset of detail field
-#define MCU_PACKET_DETAIL_OFFSET 8
+#define MCU_PACKET_HEADER_SIZE	6
+#define MCU_PACKET_MAX_LENGTH	250
 
 struct mcu_bus_device;
 struct mcu_packet;
+struct mcu_packet_private;
+struct mcu_event;
+
+/*
+ * a sent frame from the per bus pool,
+ * plain metadata is kept to match the response
+ */
+struct mcu_tx_frame {
+	struct mcu_packet_private *pool;
+	struct list_head node;
+
+	// requests are in flight until the response completes them or the frame is freed
+	struct hlist_node inflight;
+	unsigned int key;
+	struct completion done;
+	struct mcu_packet *reply;
+	// optional, called once the response is in, in any context and must not sleep
+	void (*complete)(struct mcu_tx_frame *);
+	void *context;
+
+	unsigned char identity;
+	unsigned char tag;
+	unsigned char tx_class;
+	mcu_device_id device_id;
+	mcu_control_code control_code;
+
+	// sent as segments of a transfer, data holds the last one only
+	int transfer;
+	// xored wire image
+	int len;
+	unsigned char data[MCU_PACKET_HEADER_SIZE + MCU_PACKET_MAX_LENGTH];
+};
 
 struct mcu_packet_callback {
-	/* low level write operation */
-	int (*write)(struct mcu_bus_device *, const void *cp, int count);
+	/* queue a whole frame in a class, waiting up to timeout ms for room */
+	int (*write)(struct mcu_bus_device *, const void *cp, int count, enum mcu_tx_class, int timeout);
 
-	/* ping request detected */
+	/* ping request detected, may be called in the receive context */
 	void (*ping)(struct mcu_bus_device *, struct mcu_packet *);
 
-	/* ping response detected */
-	void (*pong)(struct mcu_bus_device *, struct mcu_packet *);
-
-	/* device control request detected */
+	/* device control request detected, may be called in the receive context */
 	void (*new_request)(struct mcu_bus_device *, struct mcu_packet *);
-
-	/* device control response detected */
-	void (*new_response)(struct mcu_bus_device *, struct mcu_packet *);
 };
 
 extern int mcu_packet_init(struct mcu_bus_device *, struct mcu_packet_callback *callback) __init;
 extern void mcu_packet_deinit(struct mcu_bus_device *) __exit;
 
-/* the send packet should not be free before got reply */
-extern void mcu_packet_free(struct mcu_packet *);
+/* received packets are refcounted, callbacks get a borrowed reference */
+extern struct mcu_packet *mcu_packet_get(struct mcu_packet *);
+extern void mcu_packet_put(struct mcu_packet *);
+/* the event to queue the packet with, a packet is queued once at a time */
+extern struct mcu_event *mcu_packet_event(struct mcu_packet *);
+/* the sent frame should not be free before got reply or timeout */
+extern void mcu_tx_frame_free(struct mcu_tx_frame *);
+/* write a request again with its tag, answers to either send complete it */
+extern int mcu_packet_can_resend(const struct mcu_tx_frame *);
+extern int mcu_packet_resend(struct mcu_bus_device *, struct mcu_tx_frame *);
 extern int mcu_packet_extract_control_info(struct mcu_packet *, mcu_device_id *, mcu_control_code *, int *);
+extern unsigned char *mcu_packet_control_detail(struct mcu_packet *);
+/* tag of a tagged request or response, -1 if the packet has none */
+extern int mcu_packet_tag(struct mcu_packet *);
 extern int mcu_packet_copy_control_detail(struct mcu_packet *, void *, int *);
-extern int mcu_packet_response_to(const struct mcu_packet *req, const struct mcu_packet *resp);
-
-extern struct mcu_packet *mcu_packet_send_ping(struct mcu_bus_device *);
-extern struct mcu_packet *mcu_packet_send_pong(struct mcu_bus_device *);
-extern struct mcu_packet *mcu_packet_send_control_request(struct mcu_bus_device *, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len);
-extern struct mcu_packet *mcu_packet_send_control_response(struct mcu_bus_device *, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len);
+extern int mcu_packet_copy_batch_detail(struct mcu_packet *, mcu_device_id, struct mcu_command *cmds, int count);
+/* wait up to timeout ms for the response to a request, the caller owns the reference returned */
+extern struct mcu_packet *mcu_packet_wait_response(struct mcu_tx_frame *, int timeout);
+/* same without waiting, NULL if the response is not in */
+extern struct mcu_packet *mcu_packet_take_response(struct mcu_tx_frame *);
+extern int mcu_packet_tx_window_max(struct mcu_bus_device *);
+extern int mcu_packet_transfer_size_max(struct mcu_bus_device *);
+
+/* return ERR_PTR(-EBUSY) if all transmit frames of the bus are in use */
+extern struct mcu_tx_frame *mcu_packet_send_ping(struct mcu_bus_device *);
+extern struct mcu_tx_frame *mcu_packet_send_pong(struct mcu_bus_device *);
+/* complete and context are set before the request is queued, both optional */
+extern struct mcu_tx_frame *mcu_packet_send_control_request(struct mcu_bus_device *, enum mcu_tx_class, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len, void (*complete)(struct mcu_tx_frame *), void *context);
+/* count is updated to the number of commands fit in the frame */
+extern struct mcu_tx_frame *mcu_packet_send_batch_request(struct mcu_bus_device *, enum mcu_tx_class, mcu_device_id device_id, const struct mcu_command *cmds, int *count);
+extern struct mcu_tx_frame *mcu_packet_send_control_response(struct mcu_bus_device *, mcu_device_id device_id, mcu_control_code control_code, const void *cp, int len);
 
 extern int mcu_packet_receive_buffer(struct mcu_bus_device *, const void *cp, int count);
 
-/* try to detect packet in buffer, should be called after mcu_packet_receive_buffer */
-extern void mcu_packet_buffer_detect(struct mcu_bus_device *);
+/*
+ * detect packets in buffer, should be called after mcu_packet_receive_buffer,
+ * return 1 if the poll budget ran out before the buffer was drained
+ */
+extern int mcu_packet_buffer_detect(struct mcu_bus_device *);
+/*
+ * same in the receive context, callbacks must not sleep then,
+ * -EBUSY if detecting elsewhere right now
+ */
+extern int mcu_packet_buffer_try_detect(struct mcu_bus_device *);
 
 #endif	//  __MCU_PACK_H_
 
@@ -0,0 +1,172 @@
+/*
+ * mcu-trace.h
+ * mcu coprocessor bus protocol, tracepoints
+ *
+ * Author: Alex.wang
+ * Create: 2015-08-23 14:05
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mcu
+
+#if !defined(__MCU_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define __MCU_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/*
+ * tag is the request id, frames and commands carry the tag of their frame
+ * whether it is on the wire or not, received packets -1 if untagged
+ */
+DECLARE_EVENT_CLASS(mcu_frame,
+	TP_PROTO(int bus_nr, unsigned char identity, unsigned char device_id, unsigned char control_code, int len, int tag),
+	TP_ARGS(bus_nr, identity, device_id, control_code, len, tag),
+	TP_STRUCT__entry(
+		__field(int, bus_nr)
+		__field(unsigned char, identity)
+		__field(unsigned char, device_id)
+		__field(unsigned char, control_code)
+		__field(int, len)
+		__field(int, tag)
+	),
+	TP_fast_assign(
+		__entry->bus_nr = bus_nr;
+		__entry->identity = identity;
+		__entry->device_id = device_id;
+		__entry->control_code = control_code;
+		__entry->len = len;
+		__entry->tag = tag;
+	),
+	TP_printk("bus=%d identity=0x%02x device=0x%02x code=0x%02x len=%d tag=%d",
+		__entry->bus_nr, __entry->identity, __entry->device_id, __entry->control_code, __entry->len, __entry->tag)
+);
+
+/* a frame queued for the backend, each segment of a transfer */
+DEFINE_EVENT(mcu_frame, mcu_frame_tx,
+	TP_PROTO(int bus_nr, unsigned char identity, unsigned char device_id, unsigned char control_code, int len, int tag),
+	TP_ARGS(bus_nr, identity, device_id, control_code, len, tag)
+);
+
+/* a frame detected, a transfer once reassembled */
+DEFINE_EVENT(mcu_frame, mcu_frame_rx,
+	TP_PROTO(int bus_nr, unsigned char identity, unsigned char device_id, unsigned char control_code, int len, int tag),
+	TP_ARGS(bus_nr, identity, device_id, control_code, len, tag)
+);
+
+/* the response of a request is matched, its waiter woken */
+DEFINE_EVENT(mcu_frame, mcu_response_wake,
+	TP_PROTO(int bus_nr, unsigned char identity, unsigned char device_id, unsigned char control_code, int len, int tag),
+	TP_ARGS(bus_nr, identity, device_id, control_code, len, tag)
+);
+
+/* message body dropped on checksum mismatch */
+TRACE_EVENT(mcu_rx_checksum,
+	TP_PROTO(int bus_nr, unsigned char identity, int len),
+	TP_ARGS(bus_nr, identity, len),
+	TP_STRUCT__entry(
+		__field(int, bus_nr)
+		__field(unsigned char, identity)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->bus_nr = bus_nr;
+		__entry->identity = identity;
+		__entry->len = len;
+	),
+	TP_printk("bus=%d identity=0x%02x len=%d", __entry->bus_nr, __entry->identity, __entry->len)
+);
+
+/* bad header, bytes skipped looking for the next magic */
+TRACE_EVENT(mcu_rx_resync,
+	TP_PROTO(int bus_nr, int skipped),
+	TP_ARGS(bus_nr, skipped),
+	TP_STRUCT__entry(
+		__field(int, bus_nr)
+		__field(int, skipped)
+	),
+	TP_fast_assign(
+		__entry->bus_nr = bus_nr;
+		__entry->skipped = skipped;
+	),
+	TP_printk("bus=%d skipped=%d", __entry->bus_nr, __entry->skipped)
+);
+
+/* flagged events carry no packet, device, code and len are 0 and tag -1 then */
+DECLARE_EVENT_CLASS(mcu_event,
+	TP_PROTO(int bus_nr, int type, unsigned char device_id, unsigned char control_code, int len, int tag),
+	TP_ARGS(bus_nr, type, device_id, control_code, len, tag),
+	TP_STRUCT__entry(
+		__field(int, bus_nr)
+		__field(int, type)
+		__field(unsigned char, device_id)
+		__field(unsigned char, control_code)
+		__field(int, len)
+		__field(int, tag)
+	),
+	TP_fast_assign(
+		__entry->bus_nr = bus_nr;
+		__entry->type = type;
+		__entry->device_id = device_id;
+		__entry->control_code = control_code;
+		__entry->len = len;
+		__entry->tag = tag;
+	),
+	TP_printk("bus=%d type=%d device=0x%02x code=0x%02x len=%d tag=%d",
+		__entry->bus_nr, __entry->type, __entry->device_id, __entry->control_code, __entry->len, __entry->tag)
+);
+
+DEFINE_EVENT(mcu_event, mcu_event_queue,
+	TP_PROTO(int bus_nr, int type, unsigned char device_id, unsigned char control_code, int len, int tag),
+	TP_ARGS(bus_nr, type, device_id, control_code, len, tag)
+);
+
+/* taken by the bus worker */
+DEFINE_EVENT(mcu_event, mcu_event_dequeue,
+	TP_PROTO(int bus_nr, int type, unsigned char device_id, unsigned char control_code, int len, int tag),
+	TP_ARGS(bus_nr, type, device_id, control_code, len, tag)
+);
+
+/*
+ * a command is done, ret as returned to the driver, times in us since submitted:
+ * queued until first sent, sent until the response is in, 0 without a response
+ */
+TRACE_EVENT(mcu_command_complete,
+	TP_PROTO(int bus_nr, unsigned char device_id, unsigned char control_code, int len, int tag, int ret, int attempts, s64 queued, s64 replied, s64 total),
+	TP_ARGS(bus_nr, device_id, control_code, len, tag, ret, attempts, queued, replied, total),
+	TP_STRUCT__entry(
+		__field(int, bus_nr)
+		__field(unsigned char, device_id)
+		__field(unsigned char, control_code)
+		__field(int, len)
+		__field(int, tag)
+		__field(int, ret)
+		__field(int, attempts)
+		__field(s64, queued)
+		__field(s64, replied)
+		__field(s64, total)
+	),
+	TP_fast_assign(
+		__entry->bus_nr = bus_nr;
+		__entry->device_id = device_id;
+		__entry->control_code = control_code;
+		__entry->len = len;
+		__entry->tag = tag;
+		__entry->ret = ret;
+		__entry->attempts = attempts;
+		__entry->queued = queued;
+		__entry->replied = replied;
+		__entry->total = total;
+	),
+	TP_printk("bus=%d device=0x%02x code=0x%02x len=%d tag=%d ret=%d attempts=%d queued=%lld replied=%lld total=%lld",
+		__entry->bus_nr, __entry->device_id, __entry->control_code, __entry->len, __entry->tag, __entry->ret,
+		__entry->attempts, __entry->queued, __entry->replied, __entry->total)
+);
+
+#endif	// __MCU_TRACE_H_
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mcu-trace
+#include <trace/define_trace.h>
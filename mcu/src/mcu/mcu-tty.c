@@ -18,6 +18,9 @@
 
 struct mcu_bus_device *mcu_tty_bus = NULL;
 
+/* rate the tty is opened with, used unless lbs,fallback-baud says otherwise */
+#define MCU_TTY_DEFAULT_BAUD	57600
+
 struct mcu_tty_private {
 	struct mcu_bus_device bus;
 	struct device *dev;
@@ -25,6 +28,7 @@ struct mcu_tty_private {
 	char tty_name[20];
 };
 
+/* the tty takes what fits in its buffer, write wakeup tells when there is room again */
 static int mcu_tty_write(struct mcu_bus_device *device, const void *buffer, int count)
 {
 	struct mcu_tty_private *data = container_of(device, struct mcu_tty_private, bus);
@@ -45,6 +49,26 @@ static long mcu_tty_ioctl(struct file *filp, unsigned op, unsigned long param)
 	return ret;
 }
 
+/*
+ * bytes in the tty and uart buffers, the transmit queue keeps this short,
+ * asked of the driver as TIOCOUTQ is only known to n_tty
+ */
+static int mcu_tty_out_pending(struct mcu_bus_device *device)
+{
+	struct mcu_tty_private *data = container_of(device, struct mcu_tty_private, bus);
+	struct tty_struct *tty;
+
+	if (unlikely(!data->filp)) {
+		return -ENODEV;
+	}
+	tty = file_tty(data->filp);
+	if (unlikely(!tty)) {
+		return -ENODEV;
+	}
+
+	return tty_chars_in_buffer(tty);
+}
+
 static void mcu_tty_setup(struct file *filp)
 {
 	struct termios termios;
@@ -83,6 +107,38 @@ static void mcu_tty_setup(struct file *filp)
 	set_fs(oldfs);
 }
 
+/* any rate the uart can do, set on the tty directly as termios ioctls are only known to n_tty */
+static int mcu_tty_set_baud(struct mcu_bus_device *device, unsigned int baud)
+{
+	struct mcu_tty_private *data = container_of(device, struct mcu_tty_private, bus);
+	struct tty_struct *tty;
+	struct ktermios termios;
+	int ret;
+
+	if (unlikely(!data->filp)) {
+		return -EAGAIN;
+	}
+	tty = file_tty(data->filp);
+	if (unlikely(!tty)) {
+		return -ENODEV;
+	}
+
+	// let frames already written go out at the old rate
+	tty_wait_until_sent(tty, 0);
+
+	down_read(&tty->termios_rwsem);
+	termios = tty->termios;
+	up_read(&tty->termios_rwsem);
+	// BOTHER unless the rate has a Bnnn of its own
+	tty_termios_encode_baud_rate(&termios, baud, baud);
+	ret = tty_set_termios(tty, &termios);
+
+	if (ret) {
+		dev_err(data->dev, "failed to set %u baud: ret=%d\n", baud, ret);
+	}
+	return ret;
+}
+
 static int mcu_tty_late_init(struct mcu_bus_device *device)
 {
 	struct mcu_tty_private *data = container_of(device, struct mcu_tty_private, bus);
@@ -95,6 +151,9 @@ static int mcu_tty_late_init(struct mcu_bus_device *device)
 			return PTR_ERR(data->filp);
 		}
 		mcu_tty_setup(data->filp);
+		if (MCU_TTY_DEFAULT_BAUD != device->fallback_baud) {
+			mcu_tty_set_baud(device, device->fallback_baud);
+		}
 	}
 
 	return 0;
@@ -137,8 +196,18 @@ static int mcu_tty_probe(struct platform_device *op)
 	platform_set_drvdata(op, data);
 
 	snprintf(data->bus.name, sizeof(data->bus.name), "mcu-tty.%p", data);
+	data->bus.fallback_baud = MCU_TTY_DEFAULT_BAUD;
+	of_property_read_u32(op->dev.of_node, "lbs,fallback-baud", &data->bus.fallback_baud);
+	ret = of_property_count_u32_elems(op->dev.of_node, "lbs,baud-rates");
+	if (ret > 0) {
+		data->bus.nr_baud_rates = min(ret, MCU_BAUD_RATES_MAX);
+		of_property_read_u32_array(op->dev.of_node, "lbs,baud-rates", data->bus.baud_rates, data->bus.nr_baud_rates);
+	}
+
 	data->bus.late_init = mcu_tty_late_init;
 	data->bus.do_write = mcu_tty_write;
+	data->bus.out_pending = mcu_tty_out_pending;
+	data->bus.set_baud = mcu_tty_set_baud;
 	data->bus.dev.parent = &op->dev;
 	data->bus.dev.of_node = of_node_get(op->dev.of_node);
 
@@ -0,0 +1,413 @@
+/*
+ * mcu-tx.c
+ * mcu coprocessor bus protocol, transmit queue
+ *
+ * Author: Alex.wang
+ * Create: 2015-08-09 10:12
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/kfifo.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/moduleparam.h>
+#include "mcu-internal.h"
+#include "mcu-packet.h"
+
+/* size of each class of the per bus transmit queue, rounded up to power of 2 */
+static unsigned int tx_queue_size = 4096;
+module_param(tx_queue_size, uint, 0444);
+MODULE_PARM_DESC(tx_queue_size, "size in bytes of each transmit class queue per bus");
+
+/* how long queued frames may wait for more to write them at once, 0 to disable */
+static unsigned int tx_coalesce_usecs = 200;
+module_param(tx_coalesce_usecs, uint, 0644);
+MODULE_PARM_DESC(tx_coalesce_usecs, "max time in us frames are held back to be written together");
+
+/* once this much is queued a single write is worth it without waiting */
+#define MCU_TX_COALESCE_BYTES	(MCU_PACKET_HEADER_SIZE + MCU_PACKET_MAX_LENGTH)
+
+/*
+ * bytes a class may send per round times its weight,
+ * at least a max size frame so every class progresses each round
+ */
+#define MCU_TX_QUANTUM	(MCU_PACKET_HEADER_SIZE + MCU_PACKET_MAX_LENGTH)
+/*
+ * bytes left unsent in the backend, if it can tell,
+ * frames of a higher class can not overtake what the backend already took
+ */
+#define MCU_TX_BACKEND_BYTES	(2 * MCU_TX_QUANTUM)
+/* frames looked at for one write */
+#define MCU_TX_SPAN_FRAMES	16
+
+/* classes are looked at in this order within a round */
+static const unsigned char mcu_tx_order[] = { MCU_TX_URGENT, MCU_TX_NORMAL, MCU_TX_BULK };
+static const int mcu_tx_weight[MCU_TX_CLASSES] = {
+	[MCU_TX_URGENT]	= 4,
+	[MCU_TX_NORMAL]	= 2,
+	[MCU_TX_BULK]	= 1,
+};
+
+struct mcu_tx_record {
+	u32 queued;	// us, wraps
+	unsigned short len;
+};
+
+struct mcu_tx_class_queue {
+	// wire image of queued frames, and a record of each of them
+	struct kfifo data;
+	DECLARE_KFIFO_PTR(frames, struct mcu_tx_record);
+	// tx_work only, bytes the class may still send this round
+	int deficit;
+};
+
+/*
+ * whole frames are queued from any context and written out by tx_work,
+ * classes are interleaved at frame boundaries by deficit round robin,
+ * the backend takes what fits and tx_work resumes on write wakeup
+ */
+struct mcu_tx_queue {
+	struct mcu_bus_device *bus;
+
+	struct mcu_tx_class_queue queue[MCU_TX_CLASSES];
+	// serializes producers, protects the queue stats
+	spinlock_t lock;
+	// woken whenever bytes left the queue
+	wait_queue_head_t room;
+
+	struct work_struct work;
+	// holds tx_work back while frames are coalesced
+	struct hrtimer coalesce;
+	// tx_work only, class and bytes of the head frame already written
+	int cur;
+	int head_sent;
+};
+
+static u32 mcu_tx_now(void)
+{
+	return (u32)ktime_to_us(ktime_get());
+}
+
+static int __mcu_tx_room(struct mcu_tx_class_queue *q, int count)
+{
+	return kfifo_avail(&q->data) >= count && !kfifo_is_full(&q->frames);
+}
+
+static enum hrtimer_restart mcu_tx_coalesce_expired(struct hrtimer *timer)
+{
+	struct mcu_tx_queue *tx = container_of(timer, struct mcu_tx_queue, coalesce);
+
+	schedule_work(&tx->work);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * frames are never split, the queue either takes all of it or nothing.
+ * the first frame of a burst starts the coalesce timer,
+ * tx_work runs at once if enough is queued or coalescing is off
+ */
+static int __mcu_tx_enqueue(struct mcu_tx_queue *tx, struct mcu_tx_class_queue *q, const void *cp, int count)
+{
+	struct mcu_bus_stats *stats = &tx->bus->stats;
+	unsigned int usecs = READ_ONCE(tx_coalesce_usecs);
+	struct mcu_tx_record rec;
+	unsigned long flags;
+	int ret = -EBUSY;
+
+	rec.queued = mcu_tx_now();
+	rec.len = count;
+
+	spin_lock_irqsave(&tx->lock, flags);
+	if (likely(__mcu_tx_room(q, count))) {
+		kfifo_in(&q->data, cp, count);
+		kfifo_put(&q->frames, rec);
+		stats->tx_queue_depth++;
+		stats->tx_queue_bytes += count;
+		stats->tx_frames++;
+		stats->tx_bytes += count;
+		ret = count;
+
+		if (0 == usecs || stats->tx_queue_bytes >= MCU_TX_COALESCE_BYTES) {
+			schedule_work(&tx->work);
+		}
+		else if (!hrtimer_active(&tx->coalesce)) {
+			hrtimer_start(&tx->coalesce, ns_to_ktime((u64)usecs * NSEC_PER_USEC), HRTIMER_MODE_REL);
+		}
+	}
+	spin_unlock_irqrestore(&tx->lock, flags);
+
+	return ret;
+}
+
+/* time from queued to completely written, moving average over about 8 frames */
+static void __mcu_tx_latency(struct mcu_bus_stats *stats, int class, u32 us)
+{
+	long avg = stats->tx_latency[class];
+
+	stats->tx_latency[class] = avg + ((long)us - avg) / 8;
+	if (us > stats->tx_latency_max[class]) {
+		stats->tx_latency_max[class] = us;
+	}
+}
+
+/* account bytes the backend took, frames are done once fully written */
+static void __mcu_tx_sent(struct mcu_tx_queue *tx, struct mcu_tx_class_queue *q, int count)
+{
+	struct mcu_bus_stats *stats = &tx->bus->stats;
+	struct mcu_tx_record rec;
+	unsigned long flags;
+	u32 now;
+
+	kfifo_dma_out_finish(&q->data, count);
+	now = mcu_tx_now();
+
+	spin_lock_irqsave(&tx->lock, flags);
+	stats->tx_queue_bytes -= count;
+	tx->cur = q - tx->queue;
+	tx->head_sent += count;
+	while (kfifo_peek(&q->frames, &rec) && tx->head_sent >= rec.len) {
+		tx->head_sent -= rec.len;
+		q->deficit -= rec.len;
+		kfifo_skip(&q->frames);
+		stats->tx_queue_depth--;
+		__mcu_tx_latency(stats, tx->cur, now - rec.queued);
+	}
+	spin_unlock_irqrestore(&tx->lock, flags);
+
+	wake_up(&tx->room);
+}
+
+/*
+ * deficit round robin, a class is picked while its head frame fits its deficit,
+ * higher classes first so they overtake lower ones at the next frame boundary
+ */
+static struct mcu_tx_class_queue *__mcu_tx_pick(struct mcu_tx_queue *tx)
+{
+	struct mcu_tx_class_queue *q;
+	struct mcu_tx_record rec;
+	int i, round;
+
+	// a frame is finished before switching class
+	if (tx->head_sent) {
+		return &tx->queue[tx->cur];
+	}
+
+	// a quantum is at least a frame, so a second round always finds one
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < ARRAY_SIZE(mcu_tx_order); i++) {
+			q = &tx->queue[mcu_tx_order[i]];
+			if (kfifo_peek(&q->frames, &rec) && rec.len <= q->deficit) {
+				return q;
+			}
+		}
+		for (i = 0; i < MCU_TX_CLASSES; i++) {
+			q = &tx->queue[i];
+			// idle classes do not save up
+			q->deficit = kfifo_is_empty(&q->frames) ? 0 : q->deficit + MCU_TX_QUANTUM * mcu_tx_weight[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* rest of the head frame and the whole frames after it the deficit allows */
+static int __mcu_tx_span(struct mcu_tx_queue *tx, struct mcu_tx_class_queue *q)
+{
+	struct mcu_tx_record rec[MCU_TX_SPAN_FRAMES];
+	int i, n, span = 0, deficit = q->deficit;
+
+	n = kfifo_out_peek(&q->frames, rec, ARRAY_SIZE(rec));
+	for (i = 0; i < n && rec[i].len <= deficit; i++) {
+		deficit -= rec[i].len;
+		span += rec[i].len;
+	}
+
+	return span - tx->head_sent;
+}
+
+/*
+ * the only consumer of the queue, frames of a class queued so far go in one write,
+ * bytes are written in place and a partial write leaves the rest for the next wakeup
+ */
+static void mcu_tx_work(struct work_struct *work)
+{
+	struct mcu_tx_queue *tx = container_of(work, struct mcu_tx_queue, work);
+	struct mcu_bus_device *bus = tx->bus;
+	struct mcu_tx_class_queue *q;
+	struct scatterlist sg[2];
+	int i, n, len, ret;
+
+	if (unlikely(!bus->do_write)) {
+		return;
+	}
+	// flushed before the coalesce timer expired
+	hrtimer_try_to_cancel(&tx->coalesce);
+
+	while ((q = __mcu_tx_pick(tx))) {
+		len = __mcu_tx_span(tx, q);
+		if (bus->out_pending) {
+			// resumed by write wakeup once the backend drained, written as before if unknown
+			n = MCU_TX_BACKEND_BYTES - max(bus->out_pending(bus), 0);
+			if (n <= 0) {
+				return;
+			}
+			len = min(len, n);
+		}
+
+		n = kfifo_dma_out_prepare(&q->data, sg, ARRAY_SIZE(sg), len);
+		for (i = 0; i < n; i++) {
+			ret = bus->do_write(bus, sg_virt(&sg[i]), sg[i].length);
+			if (ret > 0) {
+				bus->stats.tx_writes++;
+				__mcu_tx_sent(tx, q, ret);
+			}
+			if (ret < (int)sg[i].length) {
+				// -EAGAIN until the backend is opened by late_init
+				if (ret < 0 && -EAGAIN != ret) {
+					dev_err_ratelimited(&bus->dev, "transmit failed, %u bytes queued: ret=%d\n", bus->stats.tx_queue_bytes, ret);
+				}
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * queue a whole frame in a class, waiting up to timeout ms for room,
+ * return count, or -EBUSY if the queue stayed full
+ */
+int mcu_tx_queue_frame(struct mcu_bus_device *bus, const void *cp, int count, enum mcu_tx_class tx_class, int timeout)
+{
+	struct mcu_tx_queue *tx = bus->tx_data;
+	unsigned long expire = jiffies + msecs_to_jiffies(timeout);
+	struct mcu_tx_class_queue *q;
+	long left;
+	int ret;
+
+	if (unlikely(!tx || tx_class >= MCU_TX_CLASSES)) {
+		return -EINVAL;
+	}
+	q = &tx->queue[tx_class];
+	if (unlikely(count <= 0 || count > kfifo_size(&q->data) || count > USHRT_MAX)) {
+		return -EINVAL;
+	}
+
+	while (-EBUSY == (ret = __mcu_tx_enqueue(tx, q, cp, count))) {
+		left = (long)(expire - jiffies);
+		if (left <= 0) {
+			bus->stats.tx_queue_full++;
+			return ret;
+		}
+		// nothing makes room while frames are held back
+		schedule_work(&tx->work);
+		wait_event_timeout(tx->room, __mcu_tx_room(q, count), left);
+	}
+
+	return ret;
+}
+
+/*
+ * write queued frames now without waiting for more, the backend has room again
+ * or a caller waits for the response, may be called in atomic context
+ */
+void mcu_tx_flush(struct mcu_bus_device *bus)
+{
+	struct mcu_tx_queue *tx = bus->tx_data;
+
+	if (likely(tx)) {
+		schedule_work(&tx->work);
+	}
+}
+
+/* frames not completely written yet, and their bytes left */
+int mcu_tx_pending(struct mcu_bus_device *bus, int *bytes)
+{
+	struct mcu_tx_queue *tx = bus->tx_data;
+	unsigned long flags;
+	int depth = 0;
+
+	if (bytes) {
+		*bytes = 0;
+	}
+	if (unlikely(!tx)) {
+		return 0;
+	}
+
+	spin_lock_irqsave(&tx->lock, flags);
+	depth = bus->stats.tx_queue_depth;
+	if (bytes) {
+		*bytes = bus->stats.tx_queue_bytes;
+	}
+	spin_unlock_irqrestore(&tx->lock, flags);
+
+	return depth;
+}
+
+static void __mcu_tx_free_queues(struct mcu_tx_queue *tx)
+{
+	int i;
+
+	for (i = 0; i < MCU_TX_CLASSES; i++) {
+		kfifo_free(&tx->queue[i].frames);
+		kfifo_free(&tx->queue[i].data);
+	}
+}
+
+int mcu_tx_init(struct mcu_bus_device *bus)
+{
+	struct mcu_tx_queue *tx;
+	unsigned int size;
+	int i, ret;
+
+	tx = kzalloc(sizeof(*tx), GFP_KERNEL);
+	if (unlikely(!tx)) {
+		return -ENOMEM;
+	}
+	tx->bus = bus;
+
+	// must hold at least one max size frame
+	size = max(tx_queue_size, (unsigned int)(MCU_PACKET_HEADER_SIZE + MCU_PACKET_MAX_LENGTH));
+	for (i = 0; i < MCU_TX_CLASSES; i++) {
+		struct mcu_tx_class_queue *q = &tx->queue[i];
+		ret = kfifo_alloc(&q->data, size, GFP_KERNEL);
+		if (unlikely(ret)) {
+			goto exit_free_queues;
+		}
+		// records for short frames, control requests are 8 bytes and more
+		ret = kfifo_alloc(&q->frames, kfifo_size(&q->data) / 8, GFP_KERNEL);
+		if (unlikely(ret)) {
+			goto exit_free_queues;
+		}
+	}
+
+	spin_lock_init(&tx->lock);
+	init_waitqueue_head(&tx->room);
+	INIT_WORK(&tx->work, mcu_tx_work);
+	hrtimer_init(&tx->coalesce, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tx->coalesce.function = mcu_tx_coalesce_expired;
+	bus->stats.tx_queue_size = kfifo_size(&tx->queue[0].data);
+	bus->tx_data = tx;
+	return 0;
+
+exit_free_queues:
+	// kfifo_free() is fine with a fifo never allocated
+	__mcu_tx_free_queues(tx);
+	kfree(tx);
+	return ret;
+}
+
+void mcu_tx_deinit(struct mcu_bus_device *bus)
+{
+	struct mcu_tx_queue *tx = bus->tx_data;
+
+	if (tx) {
+		bus->tx_data = NULL;
+		hrtimer_cancel(&tx->coalesce);
+		cancel_work_sync(&tx->work);
+		__mcu_tx_free_queues(tx);
+	}
+	kfree(tx);
+}